@@ -0,0 +1,186 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// admission.cpp
+// admission file
+// CMPS 109
+// Assignment 4
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <new>
+using namespace std;
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "admission.h"
+
+static constexpr auto POLL_INTERVAL = chrono::milliseconds (5);
+
+struct token_bucket {
+   bool used {false};
+   uint64_t key {};
+   double tokens {0};
+   int64_t last_ns {0};
+};
+
+struct admission::shared_state {
+   pthread_mutex_t lock;
+   atomic<pid_t> transfers[MAX_TRANSFERS];
+   token_bucket global;
+   token_bucket clients[CLIENT_BUCKETS];
+};
+static_assert (atomic<pid_t>::is_always_lock_free);
+
+// Lock guard for the process-shared robust mutex: a child killed
+// while holding it must not wedge every other server.
+class robust_guard {
+   private:
+      pthread_mutex_t* mutex;
+   public:
+      robust_guard (pthread_mutex_t* mutex_): mutex (mutex_) {
+         if (pthread_mutex_lock (mutex) == EOWNERDEAD) {
+            pthread_mutex_consistent (mutex);
+         }
+      }
+      ~robust_guard() { pthread_mutex_unlock (mutex); }
+};
+
+static int64_t monotonic_ns() {
+    timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1'000'000'000LL + now.tv_nsec;
+}
+
+// Charges nbytes and returns how many seconds of debt remain.
+static double charge (token_bucket& bucket, double rate,
+                      double burst, int64_t now, size_t nbytes) {
+    double refill = (now - bucket.last_ns) * rate / 1e9;
+    bucket.tokens = min (burst, bucket.tokens + refill);
+    bucket.last_ns = now;
+    bucket.tokens -= nbytes;
+    return bucket.tokens < 0 ? -bucket.tokens / rate : 0;
+}
+
+admission::admission (const config& conf_): conf (conf_) {
+    void* memory = ::mmap (nullptr, sizeof (shared_state),
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw bad_alloc();
+    state = new (memory) shared_state();
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init (&state->lock, &attr);
+    pthread_mutexattr_destroy (&attr);
+}
+
+admission::~admission() {
+    ::munmap (state, sizeof (shared_state));
+}
+
+bool admission::try_connection() {
+    size_t count = connections.load();
+    do {
+        if (conf.max_connections > 0
+            and count >= conf.max_connections) return false;
+    }while (not connections.compare_exchange_weak (count, count + 1));
+    return true;
+}
+
+void admission::release_connection() {
+    --connections;
+}
+
+// Queue mode waits for a free connection; fail_fast returns false
+// so the caller can NAK the connection it already accepted.
+task<bool> admission::wait_connection() {
+    while (not try_connection()) {
+        if (conf.fail_fast) co_return false;
+        co_await sleep_for (POLL_INTERVAL);
+    }
+    co_return true;
+}
+
+int admission::try_transfer() {
+    size_t count = min (conf.max_transfers, MAX_TRANSFERS);
+    pid_t self = getpid();
+    for (size_t index = 0; index < count; ++index) {
+        pid_t owner = 0;
+        atomic<pid_t>& transfer = state->transfers[index];
+        if (transfer.compare_exchange_strong (owner, self)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+void admission::release_transfer (int index) {
+    state->transfers[index].store (0);
+}
+
+// Small transfers bypass the cap and get a slot that holds nothing.
+task<optional<admission::slot>>
+admission::wait_transfer (size_t nbytes) {
+    if (conf.max_transfers == 0 or nbytes < conf.small_transfer) {
+        co_return slot();
+    }
+    for (;;) {
+        int index = try_transfer();
+        if (index >= 0) co_return slot (this, index);
+        if (conf.fail_fast) co_return nullopt;
+        co_await sleep_for (POLL_INTERVAL);
+    }
+}
+
+void admission::reap (pid_t pid) {
+    for (atomic<pid_t>& owner: state->transfers) {
+        pid_t expected = pid;
+        owner.compare_exchange_strong (expected, 0);
+    }
+}
+
+task<> admission::throttle (uint64_t client, size_t nbytes,
+                            bool bulk) {
+    if (conf.client_rate <= 0 and conf.global_rate <= 0) co_return;
+    double delay = 0;
+    {
+        robust_guard guard (&state->lock);
+        int64_t now = monotonic_ns();
+        double min_burst = 2.0 * conf.small_transfer;
+        if (conf.global_rate > 0) {
+            token_bucket& bucket = state->global;
+            double burst = max (conf.global_rate / 8, min_burst);
+            if (not bucket.used) bucket = {true, 0, burst, now};
+            delay = charge (bucket, conf.global_rate, burst, now,
+                            nbytes);
+        }
+        if (conf.client_rate > 0) {
+            double burst = max (conf.client_rate / 8, min_burst);
+            token_bucket* bucket = &state->clients[0];
+            for (token_bucket& candidate: state->clients) {
+                if (candidate.used and candidate.key == client) {
+                    bucket = &candidate;
+                    break;
+                }
+                if (not candidate.used
+                    or candidate.last_ns < bucket->last_ns) {
+                    bucket = &candidate;
+                }
+            }
+            if (not bucket->used or bucket->key != client) {
+                *bucket = {true, client, burst, now};
+            }
+            delay = max (delay, charge (*bucket, conf.client_rate,
+                                        burst, now, nbytes));
+        }
+    }
+    if (bulk and delay > 0) {
+        co_await sleep_for (chrono::duration_cast
+                 <scheduler::clock::duration> (
+                     chrono::duration<double> (delay)));
+    }
+}
+
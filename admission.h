@@ -0,0 +1,86 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// admission.h
+// admission file
+// CMPS 109
+// Assignment 4
+
+//
+// class admission
+// admission control and bandwidth fairness for cixd.
+//
+// Connections: capped by max_connections, counted by the process
+// that accepts (the parent in fork mode, the loop in event mode).
+// Transfers: GET/PUT bodies of at least small_transfer bytes each
+// hold one of max_transfers slots, kept in shared memory so that
+// forked servers share them; slots of a dead child are reclaimed
+// when it is reaped.  Beyond either cap the caller either waits
+// (queue) or is told to NAK with EAGAIN (fail_fast).
+// Bandwidth: token buckets per client, keyed by transport::peer_key
+// (its process for a Unix socket peer), and global, also in shared
+// memory.  Every chunk is charged; only bulk transfers wait off
+// their debt, so small requests are never queued behind them.
+// A zero limit disables that check.
+//
+
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <atomic>
+#include <optional>
+using namespace std;
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "async.h"
+#include "sockets.h"
+
+class admission {
+   public:
+      static constexpr size_t MAX_TRANSFERS = 1024;
+      static constexpr size_t CLIENT_BUCKETS = 256;
+      struct config {
+         size_t max_connections {0};
+         size_t max_transfers {0};
+         bool fail_fast {false};
+         double client_rate {0}; // bytes per second
+         double global_rate {0};
+         size_t small_transfer {0x10000};
+      };
+      class slot {
+         private:
+            admission* owner {nullptr};
+            int index {-1};
+         public:
+            slot() {}
+            slot (admission* owner_, int index_):
+                  owner (owner_), index (index_) {}
+            slot (slot&& that): owner (that.owner),
+                  index (exchange (that.index, -1)) {}
+            slot& operator= (slot&&) = delete;
+            ~slot() { if (index >= 0) owner->release_transfer (index); }
+      };
+   private:
+      struct shared_state;
+      const config conf;
+      shared_state* state;
+      atomic<size_t> connections {0};
+      int try_transfer();
+      void release_transfer (int index);
+   public:
+      explicit admission (const config& conf);
+      admission (const admission&) = delete;
+      admission& operator= (const admission&) = delete;
+      ~admission();
+      const config& limits() const { return conf; }
+      bool try_connection();
+      void release_connection(); // async-signal-safe
+      task<bool> wait_connection();
+      task<optional<slot>> wait_transfer (size_t nbytes);
+      void reap (pid_t pid); // async-signal-safe
+      task<> throttle (uint64_t client, size_t nbytes, bool bulk);
+};
+
+#endif
+
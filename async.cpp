@@ -0,0 +1,245 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// async.cpp
+// async file
+// CMPS 109
+// Assignment 4
+
+#include <cerrno>
+#include <thread>
+using namespace std;
+
+#include <poll.h>
+
+#include "async.h"
+
+thread_local scheduler* scheduler::current_ = nullptr;
+
+// Spawned tasks are owned by a self-destroying wrapper coroutine
+// that starts from the ready queue.  Its promise keeps it in
+// spawned, and retires it from there and from live however the
+// frame ends, run to completion or destroyed with the scheduler.
+struct scheduler::detached {
+   struct promise_type {
+      scheduler* sched;
+      promise_type (scheduler* sched_, task<>&): sched (sched_) {}
+      ~promise_type() {
+         --sched->live;
+         sched->spawned.erase (coroutine_handle<promise_type>
+                               ::from_promise (*this).address());
+      }
+      detached get_return_object() {
+         return {coroutine_handle<promise_type>::from_promise (*this)};
+      }
+      suspend_always initial_suspend() noexcept { return {}; }
+      suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { terminate(); }
+   };
+   coroutine_handle<> handle;
+};
+
+// The scheduler is only for the promise, which takes it from the
+// arguments.
+scheduler::detached scheduler::run_detached (scheduler*,
+                                             task<> work) {
+    co_await move (work);
+}
+
+scheduler::scheduler() {
+    epoll_fd = ::epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw socket_sys_error ("epoll_create1");
+}
+
+// Tasks still suspended, on a timer or a descriptor that will not
+// be polled again, are destroyed with everything their frames own.
+scheduler::~scheduler() {
+    while (not spawned.empty()) {
+        coroutine_handle<>::from_address (*spawned.begin()).destroy();
+    }
+    ::close (epoll_fd);
+}
+
+void scheduler::spawn (task<> work) {
+    ++live;
+    coroutine_handle<> handle = run_detached (this, move (work)).handle;
+    spawned.insert (handle.address());
+    ready.push_back (handle);
+}
+
+int scheduler::next_timeout() const {
+    if (not ready.empty()) return 0;
+    if (timers.empty()) return -1;
+    auto delay = timers.begin()->first - clock::now();
+    if (delay <= clock::duration::zero()) return 0;
+    return chrono::ceil<chrono::milliseconds> (delay).count();
+}
+
+void scheduler::expire_timers() {
+    clock::time_point now = clock::now();
+    while (not timers.empty() and timers.begin()->first <= now) {
+        waiter* wait = timers.begin()->second;
+        timers.erase (timers.begin());
+        wait->timer.reset();
+        if (wait->fd >= 0) {
+            wait->timed_out = true;
+            ::epoll_ctl (epoll_fd, EPOLL_CTL_DEL, wait->fd, nullptr);
+        }
+        ready.push_back (wait->handle);
+    }
+}
+
+void scheduler::run() {
+    scheduler* outer = exchange (current_, this);
+    stopping = false;
+    epoll_event events[64];
+    try {
+        while (live > 0 and not stopping) {
+            while (not ready.empty()) {
+                coroutine_handle<> handle = ready.front();
+                ready.pop_front();
+                handle.resume();
+            }
+            if (live == 0 or stopping) break;
+            int count = ::epoll_wait (epoll_fd, events, 64,
+                                      next_timeout());
+            if (count < 0 and errno != EINTR) {
+                throw socket_sys_error ("epoll_wait");
+            }
+            for (int index = 0; index < count; ++index) {
+                waiter* wait = static_cast<waiter*>
+                               (events[index].data.ptr);
+                if (wait->timer) {
+                    timers.erase (*wait->timer);
+                    wait->timer.reset();
+                }
+                ready.push_back (wait->handle);
+            }
+            expire_timers();
+        }
+    }catch (...) {
+        current_ = outer;
+        throw;
+    }
+    current_ = outer;
+}
+
+void scheduler::wait_io (waiter& wait, uint32_t events,
+                         optional<clock::time_point> deadline) {
+    epoll_event event {};
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = &wait;
+    int status = ::epoll_ctl (epoll_fd, EPOLL_CTL_ADD, wait.fd, &event);
+    if (status < 0 and errno == EEXIST) {
+        status = ::epoll_ctl (epoll_fd, EPOLL_CTL_MOD, wait.fd, &event);
+    }
+    if (status < 0) throw socket_sys_error ("epoll_ctl("
+                        + to_string (wait.fd) + ")");
+    if (deadline) wait.timer = timers.emplace (*deadline, &wait);
+}
+
+void scheduler::wait_until (waiter& wait, clock::time_point deadline) {
+    wait.timer = timers.emplace (deadline, &wait);
+}
+
+
+bool io_awaiter::await_ready() {
+    if (scheduler::current() != nullptr) return false;
+    pollfd pfd {fd, static_cast<short> (events), 0};
+    int status;
+    do {
+        status = ::poll (&pfd, 1, timeout_ms);
+    }while (status < 0 and errno == EINTR);
+    if (status < 0) throw socket_sys_error ("poll");
+    wait.timed_out = status == 0;
+    return true;
+}
+
+void io_awaiter::await_suspend (coroutine_handle<> handle) {
+    wait.handle = handle;
+    wait.fd = fd;
+    optional<scheduler::clock::time_point> deadline;
+    if (timeout_ms >= 0) {
+        deadline = scheduler::clock::now()
+                 + chrono::milliseconds (timeout_ms);
+    }
+    scheduler::current()->wait_io (wait, events, deadline);
+}
+
+bool sleep_awaiter::await_ready() {
+    if (delay <= scheduler::clock::duration::zero()) return true;
+    if (scheduler::current() != nullptr) return false;
+    this_thread::sleep_for (delay);
+    return true;
+}
+
+void sleep_awaiter::await_suspend (coroutine_handle<> handle) {
+    wait.handle = handle;
+    scheduler::current()->wait_until (wait,
+                                      scheduler::clock::now() + delay);
+}
+
+
+//
+// Socket operations.  Without a scheduler these are the plain
+// blocking calls; with one they never block the thread.
+//
+
+task<size_t> async_send (base_socket& sock,
+                         const void* buffer, size_t bufsize) {
+    if (scheduler::current() == nullptr) {
+        co_return sock.send (buffer, bufsize);
+    }
+    for (;;) {
+        ssize_t nbytes = sock.try_send (buffer, bufsize);
+        if (nbytes >= 0) co_return nbytes;
+        co_await wait_writable (sock.fd());
+    }
+}
+
+task<size_t> async_send (base_socket& sock,
+                         const iovec* iov, size_t iovcnt) {
+    if (scheduler::current() == nullptr) {
+        co_return sock.send (iov, iovcnt);
+    }
+    for (;;) {
+        ssize_t nbytes = sock.try_send (iov, iovcnt);
+        if (nbytes >= 0) co_return nbytes;
+        co_await wait_writable (sock.fd());
+    }
+}
+
+task<size_t> async_send_fd (base_socket& sock, const void* buffer,
+                            size_t bufsize, int fd) {
+    if (scheduler::current() == nullptr) {
+        co_return sock.send_fd (buffer, bufsize, fd);
+    }
+    for (;;) {
+        ssize_t nbytes = sock.try_send_fd (buffer, bufsize, fd);
+        if (nbytes >= 0) co_return nbytes;
+        co_await wait_writable (sock.fd());
+    }
+}
+
+task<size_t> async_recv (base_socket& sock,
+                         void* buffer, size_t bufsize) {
+    if (scheduler::current() == nullptr) {
+        co_return sock.recv (buffer, bufsize);
+    }
+    for (;;) {
+        ssize_t nbytes = sock.try_recv (buffer, bufsize);
+        if (nbytes >= 0) co_return nbytes;
+        co_await wait_readable (sock.fd());
+    }
+}
+
+task<> async_accept (server_socket& listener, accepted_socket& sock) {
+    if (scheduler::current() == nullptr) {
+        listener.accept (sock);
+        co_return;
+    }
+    while (not listener.try_accept (sock)) {
+        co_await wait_readable (listener.fd());
+    }
+}
+
@@ -0,0 +1,216 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// async.h
+// async file
+// CMPS 109
+// Assignment 4
+
+//
+// C++20 coroutine support for cix and cixd.
+//
+// template class task<T>
+// lazily started coroutine; co_await runs it and yields its
+// result or rethrows its exception.
+//
+// class scheduler
+// single threaded epoll event loop that resumes coroutines when
+// their file descriptor is ready or their timer expires.  Spawned
+// tasks still unfinished when it is destroyed are destroyed too.
+//
+// Every awaitable checks scheduler::current() first.  With no
+// scheduler running on this thread it completes synchronously
+// (blocking syscall, poll or nanosleep), so the same coroutine code
+// serves the forked one-process-per-connection server and the sync
+// client through sync_wait, and the event driven server through
+// scheduler::spawn.
+//
+
+#ifndef __ASYNC_H__
+#define __ASYNC_H__
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <unordered_set>
+#include <utility>
+using namespace std;
+
+#include <sys/epoll.h>
+
+#include "sockets.h"
+
+template <typename T> class task;
+
+struct task_promise_base {
+   coroutine_handle<> continuation {noop_coroutine()};
+   exception_ptr error;
+   struct final_awaiter {
+      bool await_ready() noexcept { return false; }
+      template <typename P>
+      coroutine_handle<> await_suspend (coroutine_handle<P> handle)
+                         noexcept {
+         return handle.promise().continuation;
+      }
+      void await_resume() noexcept {}
+   };
+   suspend_always initial_suspend() noexcept { return {}; }
+   final_awaiter final_suspend() noexcept { return {}; }
+   void unhandled_exception() { error = current_exception(); }
+};
+
+template <typename T>
+struct task_promise: task_promise_base {
+   optional<T> value;
+   task<T> get_return_object();
+   template <typename U>
+   void return_value (U&& result) {
+      value.emplace (forward<U> (result));
+   }
+   T result() {
+      if (error) rethrow_exception (error);
+      return move (*value);
+   }
+};
+
+template <>
+struct task_promise<void>: task_promise_base {
+   task<void> get_return_object();
+   void return_void() {}
+   void result() { if (error) rethrow_exception (error); }
+};
+
+template <typename T = void>
+class [[nodiscard]] task {
+   public:
+      using promise_type = task_promise<T>;
+      using handle_type = coroutine_handle<promise_type>;
+   private:
+      handle_type handle;
+   public:
+      explicit task (handle_type handle_): handle (handle_) {}
+      task (task&& that): handle (exchange (that.handle, nullptr)) {}
+      task (const task&) = delete;
+      task& operator= (const task&) = delete;
+      ~task() { if (handle) handle.destroy(); }
+      auto operator co_await() && noexcept {
+         struct awaiter {
+            handle_type handle;
+            bool await_ready() { return handle.done(); }
+            coroutine_handle<> await_suspend (coroutine_handle<> cont) {
+               handle.promise().continuation = cont;
+               return handle;
+            }
+            T await_resume() { return handle.promise().result(); }
+         };
+         return awaiter {handle};
+      }
+      template <typename U> friend U sync_wait (task<U>&&);
+};
+
+template <typename T>
+task<T> task_promise<T>::get_return_object() {
+   return task<T> {task<T>::handle_type::from_promise (*this)};
+}
+
+inline task<void> task_promise<void>::get_return_object() {
+   return task<void> {task<void>::handle_type::from_promise (*this)};
+}
+
+// Runs a task to completion on a thread with no scheduler.
+template <typename T>
+T sync_wait (task<T>&& work) {
+   work.handle.resume();
+   if (not work.handle.done()) {
+      throw logic_error ("sync_wait: task suspended without scheduler");
+   }
+   return work.handle.promise().result();
+}
+
+
+class scheduler {
+   public:
+      using clock = chrono::steady_clock;
+      struct waiter {
+         coroutine_handle<> handle;
+         int fd {-1};
+         bool timed_out {false};
+         optional<multimap<clock::time_point, waiter*>::iterator> timer;
+      };
+   private:
+      int epoll_fd;
+      size_t live {0};
+      bool stopping {false};
+      deque<coroutine_handle<>> ready;
+      unordered_set<void*> spawned;
+      multimap<clock::time_point, waiter*> timers;
+      static thread_local scheduler* current_;
+      struct detached;
+      static detached run_detached (scheduler* sched, task<> work);
+      int next_timeout() const;
+      void expire_timers();
+   public:
+      scheduler();
+      scheduler (const scheduler&) = delete;
+      scheduler& operator= (const scheduler&) = delete;
+      ~scheduler();
+      static scheduler* current() { return current_; }
+      void spawn (task<> work);
+      void run();
+      void stop() { stopping = true; }
+      size_t tasks() const { return live; }
+      void wait_io (waiter& wait, uint32_t events,
+                    optional<clock::time_point> deadline);
+      void wait_until (waiter& wait, clock::time_point deadline);
+};
+
+//
+// Awaitables.  wait_readable and wait_writable return false if
+// the timeout (milliseconds, negative for none) expired first.
+//
+
+struct io_awaiter {
+   int fd;
+   uint32_t events;
+   int timeout_ms;
+   scheduler::waiter wait {};
+   bool await_ready();
+   void await_suspend (coroutine_handle<> handle);
+   bool await_resume() const { return not wait.timed_out; }
+};
+
+inline io_awaiter wait_readable (int fd, int timeout_ms = -1) {
+   return io_awaiter {fd, EPOLLIN, timeout_ms};
+}
+
+inline io_awaiter wait_writable (int fd, int timeout_ms = -1) {
+   return io_awaiter {fd, EPOLLOUT, timeout_ms};
+}
+
+struct sleep_awaiter {
+   scheduler::clock::duration delay;
+   scheduler::waiter wait {};
+   bool await_ready();
+   void await_suspend (coroutine_handle<> handle);
+   void await_resume() const {}
+};
+
+inline sleep_awaiter sleep_for (scheduler::clock::duration delay) {
+   return sleep_awaiter {delay};
+}
+
+task<size_t> async_send (base_socket& sock,
+                         const void* buffer, size_t bufsize);
+task<size_t> async_send (base_socket& sock,
+                         const iovec* iov, size_t iovcnt);
+task<size_t> async_send_fd (base_socket& sock, const void* buffer,
+                            size_t bufsize, int fd);
+task<size_t> async_recv (base_socket& sock,
+                         void* buffer, size_t bufsize);
+task<> async_accept (server_socket& listener, accepted_socket& sock);
+
+#endif
+
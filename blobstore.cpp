@@ -0,0 +1,146 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// blobstore.cpp
+// blobstore file
+// CMPS 109
+// Assignment 4
+
+#include <cerrno>
+#include <cstdio>
+using namespace std;
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blobstore.h"
+
+static string prefix_name (unsigned prefix) {
+    char buffer[4];
+    snprintf (buffer, sizeof buffer, "%02x", prefix);
+    return buffer;
+}
+
+bool valid_hash (const string& hash) {
+    if (hash.size() != 64) return false;
+    for (char digit: hash) {
+        if (not (digit >= '0' and digit <= '9')
+            and not (digit >= 'a' and digit <= 'f')) return false;
+    }
+    return true;
+}
+
+
+//
+// blob_store
+//
+
+blob_store::blob_store (const string& root_, write_engine& engine_,
+                        chrono::seconds interval_):
+        root (root_), engine (engine_), interval (interval_) {
+}
+
+int blob_store::create() {
+    if (::mkdir (root.c_str(), 0777) < 0 and errno != EEXIST) {
+        return errno;
+    }
+    for (unsigned prefix = 0; prefix < PREFIXES; ++prefix) {
+        string directory = root + "/" + prefix_name (prefix);
+        if (::mkdir (directory.c_str(), 0777) < 0 and errno != EEXIST) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+string blob_store::path_of (const string& hash) const {
+    return root + "/" + hash.substr (0, 2) + "/" + hash;
+}
+
+// An upload with no digest is committed unshared.
+task<int> blob_store::commit (write_engine::upload& file,
+                              const string& hash) {
+    if (not valid_hash (hash)) co_return co_await file.commit();
+    co_return co_await file.commit (path_of (hash));
+}
+
+// A blob that cannot be linked where path is, on another
+// filesystem, is as good as missing: the client sends the data.
+// So is one whose mode or owner differ from a file it would
+// replace, as a link would give the file those of the blob.
+task<int> blob_store::link (const string& hash, off_t size,
+                            const string& path) {
+    if (not valid_hash (hash)) co_return EINVAL;
+    string blob = path_of (hash);
+    struct stat stat_buf;
+    if (::stat (blob.c_str(), &stat_buf) < 0) co_return errno;
+    if (stat_buf.st_size != size) co_return ENOENT;
+    struct stat old;
+    if (::stat (path.c_str(), &old) == 0
+        and (old.st_mode != stat_buf.st_mode
+             or old.st_uid != stat_buf.st_uid
+             or old.st_gid != stat_buf.st_gid)) co_return ENOENT;
+    write_engine::upload file (engine);
+    int error = file.open_link (path, blob);
+    if (error == 0) error = co_await file.commit();
+    co_return error == EXDEV ? ENOENT : error;
+}
+
+// A blob in use has the store's link and at least one more.  So
+// has an entry being added, until its temporary name is renamed
+// over the blob; anything left with one link is garbage.
+size_t blob_store::collect() {
+    last_collect = chrono::steady_clock::now();
+    size_t removed = 0;
+    for (unsigned prefix = 0; prefix < PREFIXES; ++prefix) {
+        removed += collect (prefix);
+    }
+    return removed;
+}
+
+size_t blob_store::collect (unsigned prefix) {
+    string directory = root + "/" + prefix_name (prefix);
+    DIR* dir = ::opendir (directory.c_str());
+    if (dir == nullptr) return 0;
+    int dir_fd = ::dirfd (dir);
+    size_t removed = 0;
+    while (dirent* ent = ::readdir (dir)) {
+        struct stat stat_buf;
+        if (::fstatat (dir_fd, ent->d_name, &stat_buf,
+                       AT_SYMLINK_NOFOLLOW) == 0
+            and S_ISREG (stat_buf.st_mode)
+            and stat_buf.st_nlink == 1
+            and ::unlinkat (dir_fd, ent->d_name, 0) == 0) {
+            ++removed;
+        }
+    }
+    ::closedir (dir);
+    return removed;
+}
+
+size_t blob_store::maybe_collect() {
+    if (chrono::steady_clock::now() - last_collect < interval) {
+        return 0;
+    }
+    return collect();
+}
+
+
+//
+// blob_digest
+//
+
+void blob_digest::add (uint64_t offset, const void* data,
+                       size_t size) {
+    if (offset != position) contiguous = false;
+    if (not contiguous) return;
+    digest.update (data, size);
+    position += size;
+}
+
+string blob_digest::hex (uint64_t size) {
+    if (not contiguous or position != size) return "";
+    return digest.hex();
+}
+
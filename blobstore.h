@@ -0,0 +1,90 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// blobstore.h
+// blobstore file
+// CMPS 109
+// Assignment 4
+
+//
+// class blob_store
+// content-addressed storage for cixd's deduplicating mode.  Each
+// distinct content is kept once, as a blob named by its SHA-256
+// under root (root/ab/abcd...), by default BLOB_ROOT in the served
+// directory, since a link cannot cross filesystems.  Every file
+// with that content is a hard link to it, so identical uploads
+// under different names cost one copy on disk.  Blob paths are
+// longer than a cix filename, so no request can name one.
+// create makes root and its 256 subdirectories.  commit finishes
+// an upload through the store, as write_engine::upload describes,
+// or unshared if hash is not a digest.
+// link makes path another name for the blob with hash, if there
+// is one of that size, without any data: the hash-first PUT.
+// collect removes the blobs no file links to any more, found by
+// their link count, and returns how many; with a prefix it only
+// looks in that one of the PREFIXES subdirectories, so a caller
+// can spread the work out.  maybe_collect collects everything at
+// most once per interval, the first call always.  A blob
+// linked again while it is being collected keeps that name, but
+// drops out of the store.  Errors are returned as errno values, 0
+// meaning success.  valid_hash accepts 64 lowercase hex digits,
+// as sha256 produces.
+//
+// class blob_digest
+// the SHA-256 of an upload as its data arrives, to store it by.
+// Data must arrive in order with no gaps: a sparse file, or one
+// sent out of order, gets no digest and is stored unshared.
+//
+
+#ifndef __BLOBSTORE_H__
+#define __BLOBSTORE_H__
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+using namespace std;
+
+#include <sys/types.h>
+
+#include "async.h"
+#include "sha256.h"
+#include "writer.h"
+
+constexpr const char* BLOB_ROOT = ".cix-blobs";
+
+class blob_store {
+   private:
+      const string root;
+      write_engine& engine;
+      const chrono::seconds interval;
+      chrono::steady_clock::time_point last_collect {};
+   public:
+      static constexpr unsigned PREFIXES = 256;
+      blob_store (const string& root, write_engine& engine,
+                  chrono::seconds interval);
+      blob_store (const blob_store&) = delete;
+      blob_store& operator= (const blob_store&) = delete;
+      int create();
+      string path_of (const string& hash) const;
+      task<int> commit (write_engine::upload& file,
+                        const string& hash);
+      task<int> link (const string& hash, off_t size,
+                      const string& path);
+      size_t collect();
+      size_t collect (unsigned prefix);
+      size_t maybe_collect();
+};
+
+class blob_digest {
+   private:
+      sha256 digest;
+      uint64_t position {0};
+      bool contiguous {true};
+   public:
+      void add (uint64_t offset, const void* data, size_t size);
+      string hex (uint64_t size);
+};
+
+bool valid_hash (const string& hash);
+
+#endif
+
@@ -5,24 +5,23 @@
 // CMPS 109
 // Assignment 4
 
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 using namespace std;
 
+#include <getopt.h>
 #include <libgen.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <unistd.h>
-#include <fstream>
 
-#include "protocol.h"
+#include "cluster.h"
+#include "libcix.h"
 #include "logstream.h"
-#include "sockets.h"
-
-using deleter = void (*) (void*);
 
 logstream log (cout);
 struct cix_exit: public exception {};
@@ -33,257 +32,392 @@ unordered_map<string,cix_command> command_map {
    {"ls"  , cix_command::LS  },
    {"get" , cix_command::GET },
    {"put" , cix_command::PUT },
-   {"rm"  , cix_command::RM  }
+   {"rm"  , cix_command::RM  },
+   {"copy", cix_command::COPY},
+   {"move", cix_command::MOVE},
+   {"watch", cix_command::WATCH},
+   {"append", cix_command::APPEND}
 };
 
 static const string help = R"||(
+append filename
+             - Add local file to the end of the remote file.
+copy src dst - Copy remote file to another name on the server.
 exit         - Exit the program.  Equivalent to EOF.
 get filename - Copy remote file to local host.
+get -f filename
+             - Copy remote file, then keep appending to the local
+               copy as the remote file grows, until interrupted.
 help         - Print help summary.
-ls           - List names of files on remote server.
+ls [options] - List names of files on remote server, optionally
+               matching a glob: -s name|size|mtime|none sorts,
+               -r reverses, -n count lists one page, -c cursor
+               continues after a page.
+move src dst - Rename remote file on the server.
 put filename - Copy local file to remote host.
+put -r offset length filename
+             - Write that range of local file into the same range
+               of the remote file; length 0 runs to the end.
 rm filename  - Remove file from remote server.
+watch [-n count] [glob]
+             - Print changes to remote files as they happen,
+               until count changes have been printed.
 )||";
 
 void cix_help() {
    cout << help;
 }
 
-void cix_ls (client_socket& server) {
-   cix_header header;
-   header.command = cix_command::LS;
-   log << "sending header " << header << endl;
-   send_packet (server, &header, sizeof header);
-   recv_packet (server, &header, sizeof header);
-   log << "received header " << header << endl;
-   if (header.command != cix_command::LSOUT) {
-      log << "sent LS, server did not return LSOUT" << endl;
-      log << "server returned " << header << endl;
-   }else {
-      auto buffer = make_unique<char[]> (header.nbytes + 1);
-      recv_packet (server, buffer.get(), header.nbytes);
-      log << "received " << header.nbytes << " bytes" << endl;
-      buffer[header.nbytes] = '\0';
-      cout << buffer.get();
+// Errors are reported and the session continues unless the
+// connection was left broken, which ends the session.
+
+// ls [-s name|size|mtime|none] [-r] [-n count] [-c cursor] [glob]
+// Entries are printed as they arrive.  With -n only one page is
+// listed and the cursor for the next one is logged.
+template <typename server_type>
+void cix_ls (server_type& server, const string& arguments) {
+   try {
+      cix_connection::list_options options;
+      istringstream words (arguments);
+      string word;
+      while (words >> word) {
+         if (word == "-r") options.reverse = true;
+         else if (word == "-s") words >> options.sort;
+         else if (word == "-n") words >> options.limit;
+         else if (word == "-c") words >> options.cursor;
+         else options.match = word;
+      }
+      if (not words.eof()) throw cix_error ("ls: bad option");
+      string cursor = server.list (options, [](const string& chunk) {
+         cout << chunk << flush;
+      });
+      if (not cursor.empty()) log << "more: -c " << cursor << endl;
+   }catch (cix_error& error) {
+      log << "ls: " << error.what() << endl;
+      if (server.broken()) throw;
    }
 }
 
-void cix_get(client_socket& server, string filename)
-{
-    cix_header header;
-    memset(&header, 0, sizeof(header));
-    header.command = cix_command::GET;
-    memcpy(header.filename, filename.c_str(), filename.size());
-    header.nbytes = 0;
-    log << "sending header " << header << endl;
-    send_packet (server, &header, sizeof header);
-    recv_packet (server, &header, sizeof header);
-    log << "received header " << header << endl;
-    if (header.command != cix_command::FILEOUT)
-    {
-        if (header.command == cix_command::NAK)
-        {
-            log << "error " << strerror(header.nbytes) << endl;
-        }
-        else
-        {
-            log << "sent GET, server did not return FILEOUT" << endl;
-            log << "server returned " << header << endl;
-        }
-    }
-    else
-    {
-        if (strcmp(filename.c_str(), header.filename) != 0)
-        {
-            log << "filename mismatch" << endl;
-        }
-        else
-        {
-            unique_ptr<char, deleter> buffer
-            { new char[header.nbytes], free};
-            if (header.nbytes != 0)
-            {
-                recv_packet(server, buffer.get(), header.nbytes);
+// get [-f] filename
+// A followed file is logged when it starts over, after the remote
+// file was truncated or rotated.
+template <typename server_type>
+void cix_get (server_type& server, const string& arguments) {
+   try {
+      string filename = arguments;
+      if (filename.compare (0, 3, "-f ") == 0) {
+         filename = filename.substr (3);
+         server.follow (filename, filename,
+                        [&](size_t, bool restarted) {
+            if (restarted) log << filename << ": started over" << endl;
+            return true;
+         });
+         return;
+      }
+      size_t nbytes = server.get (filename, filename);
+      log << "received " << nbytes << " bytes" << endl;
+   }catch (cix_error& error) {
+      log << "get: " << error.what() << endl;
+      if (server.broken()) throw;
+   }
+}
+
+// put [-r offset length] filename
+template <typename server_type>
+void cix_put (server_type& server, const string& arguments) {
+   try {
+      string filename = arguments;
+      size_t nbytes = 0;
+      if (filename.compare (0, 3, "-r ") == 0) {
+         istringstream words (filename.substr (3));
+         off_t offset = 0;
+         size_t length = 0;
+         if (not (words >> offset >> length >> ws)) {
+            throw cix_error ("put: need offset and length");
+         }
+         getline (words, filename);
+         nbytes = server.put_range (filename, filename, offset, length);
+      }else {
+         nbytes = server.put (filename, filename);
+      }
+      log << "sent " << nbytes << " bytes" << endl;
+   }catch (cix_error& error) {
+      log << "put: " << error.what() << endl;
+      if (server.broken()) throw;
+   }
+}
+
+template <typename server_type>
+void cix_append (server_type& server, const string& filename) {
+   try {
+      size_t nbytes = server.append (filename, filename);
+      log << "appended " << nbytes << " bytes" << endl;
+   }catch (cix_error& error) {
+      log << "append: " << error.what() << endl;
+      if (server.broken()) throw;
+   }
+}
+
+template <typename server_type>
+void cix_rm (server_type& server, const string& filename) {
+   try {
+      server.rm (filename);
+      log << "removed " << filename << endl;
+   }catch (cix_error& error) {
+      log << "rm: " << error.what() << endl;
+      if (server.broken()) throw;
+   }
+}
+
+template <typename server_type>
+void cix_copy (server_type& server, const string& filename,
+               const string& target) {
+   try {
+      server.copy (filename, target);
+      log << "copied " << filename << " to " << target << endl;
+   }catch (cix_error& error) {
+      log << "copy: " << error.what() << endl;
+      if (server.broken()) throw;
+   }
+}
+
+template <typename server_type>
+void cix_move (server_type& server, const string& filename,
+               const string& target) {
+   try {
+      server.move (filename, target);
+      log << "moved " << filename << " to " << target << endl;
+   }catch (cix_error& error) {
+      log << "move: " << error.what() << endl;
+      if (server.broken()) throw;
+   }
+}
+
+
+// watch [-n count] [glob]
+template <typename server_type>
+void cix_watch (server_type& server, const string& arguments) {
+   try {
+      istringstream words (arguments);
+      string word, match;
+      size_t limit = 0;
+      while (words >> word) {
+         if (word == "-n") words >> limit;
+         else match = word;
+      }
+      if (not words.eof()) throw cix_error ("watch: bad option");
+      size_t seen = 0;
+      server.watch (match, [&](const vector<watch_event>& events) {
+         for (const watch_event& event: events) {
+            switch (event.what) {
+               case watch_event::CREATE:
+                  cout << "created " << event.name << endl;
+                  break;
+               case watch_event::MODIFY:
+                  cout << "modified " << event.name << endl;
+                  break;
+               case watch_event::DELETE:
+                  cout << "deleted " << event.name << endl;
+                  break;
+               case watch_event::RESYNC:
+                  cout << "changes lost: list again" << endl;
+                  break;
             }
-            log << "received" << header.nbytes << " bytes" << endl;
-            ofstream file(filename);
-            file.write(buffer.get(), header.nbytes);
-            log << "wrote to file" << endl;
-            file.close();
-        }
-    }
+         }
+         seen += events.size();
+         return limit == 0 or seen < limit;
+      });
+   }catch (cix_error& error) {
+      log << "watch: " << error.what() << endl;
+      if (server.broken()) throw;
+   }
 }
 
-void cix_put(client_socket& server, string filename)
-{
-    cix_header header;
-    memset(&header, 0, sizeof(header));
-    header.command = cix_command::PUT;
-    memcpy(header.filename, filename.c_str(), filename.size());
-    ifstream file(header.filename);
-    if (!file.is_open())
-    {
-        return;
-    }
-    struct stat california;
-    if(stat(header.filename, &california) != 0)
-    {
-        log << "failed to get file stat" << endl;
-        file.close();
-        return;
-    }
-    header.nbytes = california.st_size;
-    char* buffer = new char[header.nbytes];
-    file.read(buffer,header.nbytes);
-    file.close();
-    if (!file)
-    {
-        log << "failed to read enough bytes" << endl;
-        delete[] buffer;
-        return;
-    }
-    server.send(&header, sizeof(cix_header));
-    log << "sent header" << endl;
-    server.send(buffer, header.nbytes);
-    log << "sent " << header.nbytes << " bytes" << endl;
-    delete[] buffer;
-    server.recv(&header, sizeof(cix_header));
-    if (header.command != cix_command::ACK)
-    {
-        if (header.command == cix_command::NAK)
-        {
-            log << "error " << strerror(header.nbytes) << endl;
-        }
-        else
-        {
-            log << "Unexpected packet " << header << endl;
-        }
-    }
-    else
-    {
-        log << "file successfully transfered" << endl;
-    }
-    // done
+// Reads commands against one connection or a cluster of servers
+// until EOF or exit, which end the session by throwing cix_exit.
+template <typename server_type>
+void cix_session (server_type& server) {
+   for (;;) {
+      string line, filename = "", command = "";
+      getline (cin, line);
+      auto index_to_the_first_space_ya = line.find_first_of(" ");
+      if (index_to_the_first_space_ya == string::npos)
+      {
+          command = line;
+      }
+      else
+      {
+          command = line.substr(0,index_to_the_first_space_ya);
+      }
+      if (cin.eof()) throw cix_exit();
+      log << "command " << command << endl;
+      const auto& itor = command_map.find (command);
+      cix_command cmd = itor == command_map.end()
+                      ? cix_command::ERROR : itor->second;
+      switch (cmd) {
+         case cix_command::EXIT:
+            throw cix_exit();
+            break;
+         case cix_command::HELP:
+            cix_help();
+            break;
+         case cix_command::LS:
+            cix_ls (server, line.substr (command.size()));
+            break;
+         case cix_command::GET:
+            if (index_to_the_first_space_ya == string::npos)
+            {
+                log << "filepath not specified" << endl;
+            }
+            else
+            {
+                filename = line.substr
+                        (index_to_the_first_space_ya + 1);
+                cix_get(server, filename);
+            }
+            break;
+         case cix_command::PUT:
+              if (index_to_the_first_space_ya == string::npos)
+              {
+                  log << "filepath not specified" << endl;
+              }
+              else
+              {
+                  filename = line.substr
+                          (index_to_the_first_space_ya + 1);
+                  cix_put(server, filename);
+              }
+              break;
+          case cix_command::RM:
+              if (index_to_the_first_space_ya == string::npos)
+              {
+                  log << "filepath not specified" << endl;
+              }
+              else
+              {
+                  filename = line.substr
+                          (index_to_the_first_space_ya + 1);
+                  cix_rm(server, filename);
+              }
+              break;
+         case cix_command::COPY:
+         case cix_command::MOVE: {
+            istringstream words (line.substr (command.size()));
+            string target, extra;
+            bool named = words >> filename >> target
+                         and not (words >> extra);
+            if (not named) {
+               log << command << ": need source and destination"
+                   << endl;
+            }else if (cmd == cix_command::COPY) {
+               cix_copy (server, filename, target);
+            }else {
+               cix_move (server, filename, target);
+            }
+            break;
+         }
+         case cix_command::WATCH:
+            cix_watch (server, line.substr (command.size()));
+            break;
+         case cix_command::APPEND:
+            if (index_to_the_first_space_ya == string::npos) {
+               log << "filepath not specified" << endl;
+            }else {
+               cix_append (server, line.substr
+                           (index_to_the_first_space_ya + 1));
+            }
+            break;
+         default:
+            log << command << ": invalid command" << endl;
+            break;
+      }
+   }
 }
 
-void cix_rm(client_socket& server, string filename)
-{
-    cix_header header;
-    memset(&header, 0, sizeof(header));
-    header.command = cix_command::RM;
-    memcpy(header.filename, filename.c_str(), filename.size());
-    server.send(&header, sizeof(cix_header));
-    server.recv(&header, sizeof(cix_header));
-    if (header.command != cix_command::ACK)
-    {
-        if(header.command == cix_command::NAK)
-        {
-            log << "error " << strerror(header.nbytes) << endl;
-        }
-        else
-        {
-            log << "unexpected packet " << header << endl;
-        }
-    }
-    else
-    {
-        log << "server did do the thing :D" << endl;
-    }
-    //done
+// Every argument is host:port or unix:path, and a lone argument
+// is host:port; otherwise the arguments are host and port.
+bool is_backend_list (const vector<string>& args) {
+   if (args.empty()) return false;
+   for (const string& arg: args) {
+      if (not is_unix_address (arg)
+          and arg.find (':') == string::npos) return false;
+   }
+   return args.size() > 1 or not is_unix_address (args[0]);
 }
 
-
 void usage() {
-   cerr << "Usage: " << log.execname() << " [host] [port]" << endl;
+   cerr << "Usage: " << log.execname()
+        << " [-c] [host | unix:path] [port]" << endl
+        << "       " << log.execname()
+        << " [-R replicas] host:port | unix:path ..." << endl;
    throw cix_exit();
 }
 
 int main (int argc, char** argv) {
    log.execname (basename (argv[0]));
    log << "starting" << endl;
-   vector<string> args (&argv[1], &argv[argc]);
-   if (args.size() > 2) usage();
-   string host = get_cix_server_host (args, 0);
-   in_port_t port = get_cix_server_port (args, 1);
    log << to_string (hostinfo()) << endl;
    try {
-      log << "connecting to " << host << " port " << port << endl;
-      client_socket server (host, port);
-      log << "connected to " << to_string (server) << endl;
-      for (;;) {
-         string line, filename = "", command = "";
-         getline (cin, line);
-         auto index_to_the_first_space_ya = line.find_first_of(" ");
-         if (index_to_the_first_space_ya == string::npos)
-         {
-             command = line;
+      cix_cluster::options cluster_options;
+      // The cache is never trimmed, so it is only kept on request.
+      const char* cache_env = getenv ("CIX_CACHE");
+      bool use_cache = cache_env != nullptr and *cache_env != '\0';
+      try {
+         for (;;) {
+            int option = getopt (argc, argv, "cR:");
+            if (option == EOF) break;
+            switch (option) {
+               case 'c':
+                  use_cache = true;
+                  break;
+               case 'R':
+                  cluster_options.replicas = stoul (optarg);
+                  break;
+               default:
+                  throw invalid_argument ("option");
+            }
          }
-         else
-         {
-             command = line.substr(0,index_to_the_first_space_ya);
+      }catch (logic_error&) {
+         usage();
+      }
+      vector<string> args (&argv[optind], &argv[argc]);
+      // Several servers: files are sharded over all of them.
+      if (is_backend_list (args)) {
+         vector<cix_cluster::backend> backends;
+         for (const string& arg: args) {
+            backends.push_back (parse_backend (arg));
          }
-         if (cin.eof()) throw cix_exit();
-         log << "command " << command << endl;
-         const auto& itor = command_map.find (command);
-         cix_command cmd = itor == command_map.end()
-                         ? cix_command::ERROR : itor->second;
-         switch (cmd) {
-            case cix_command::EXIT:
-               throw cix_exit();
-               break;
-            case cix_command::HELP:
-               cix_help();
-               break;
-            case cix_command::LS:
-               cix_ls (server);
-               break;
-            case cix_command::GET:
-               if (index_to_the_first_space_ya == string::npos)
-               {
-                   log << "filepath not specified" << endl;
-               }
-               else
-               {
-                   filename = line.substr
-                           (index_to_the_first_space_ya + 1);
-                   cix_get(server, filename);
-               }
-               break;
-            case cix_command::PUT:
-                 if (index_to_the_first_space_ya == string::npos)
-                 {
-                     log << "filepath not specified" << endl;
-                 }
-                 else
-                 {
-                     filename = line.substr
-                             (index_to_the_first_space_ya + 1);
-                     cix_put(server, filename);
-                 }
-                 break;
-             case cix_command::RM:
-                 if (index_to_the_first_space_ya == string::npos)
-                 {
-                     log << "filepath not specified" << endl;
-                 }
-                 else
-                 {
-                     filename = line.substr
-                             (index_to_the_first_space_ya + 1);
-                     cix_rm(server, filename);
-                 }
-                 break;
-            default:
-               log << command << ": invalid command" << endl;
-               break;
+         log << "using " << backends.size() << " servers, "
+             << cluster_options.replicas << " replicas" << endl;
+         cix_cluster cluster (backends, cluster_options);
+         cix_session (cluster);
+      }
+      if (args.size() > 2) usage();
+      string host = get_cix_server_host (args, 0);
+      in_port_t port = is_unix_address (host)
+                     ? 0 : get_cix_server_port (args, 1);
+      log << "connecting to " << host << " port " << port << endl;
+      cix_connection server (host, port);
+      log << "connected to " << to_string (server) << endl;
+      // Repeated gets of unchanged files come from the cache.
+      unique_ptr<cix_cache> cache;
+      string cache_root = use_cache ? cix_cache::default_root() : "";
+      try {
+         if (not cache_root.empty()) {
+            cache = make_unique<cix_cache> (cache_root);
+            server.use_cache (cache.get());
          }
+      }catch (cix_error& error) {
+         log << "cache disabled: " << error.what() << endl;
       }
+      cix_session (server);
    }catch (socket_error& error) {
       log << error.what() << endl;
+   }catch (cix_error& error) {
+      log << error.what() << endl;
    }catch (cix_exit& error) {
       log << "caught cix_exit" << endl;
    }
    log << "finishing" << endl;
    return 0;
 }
-
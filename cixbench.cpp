@@ -0,0 +1,310 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// cixbench.cpp
+// cixbench file
+// CMPS 109
+// Assignment 4
+
+//
+// cixbench: times the whole request path, libcix client through
+// the cixd handlers, in one process over a memory_pipe, so the
+// numbers are not drowned in network noise and repeat from run to
+// run.  Each round runs the chosen operations once in order on a
+// file of the given size; faults from fault_transport can be
+// added to both ends of the pipe.  A dropped connection counts as
+// a failure and the next operation reconnects.  With -D the
+// server stores files by content, so every put after the first
+// costs only its hash.  Files live in a temporary directory that
+// is removed at the end.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "async.h"
+#include "blobstore.h"
+#include "libcix.h"
+#include "logstream.h"
+#include "server.h"
+#include "transport.h"
+#include "writer.h"
+
+ostream log_out (nullptr);
+logstream log (log_out);
+
+struct bench_config {
+   size_t rounds {100};
+   size_t file_size {1 << 20};
+   vector<string> ops {"put", "get"};
+   bool faulty {false};
+   bool dedup {false};
+   fault_transport::faults faults;
+};
+
+struct op_stats {
+   vector<chrono::nanoseconds> times;
+   size_t failures {0};
+};
+
+using clock_type = chrono::steady_clock;
+
+const vector<string> known_ops {"put", "get", "ls", "append", "rm"};
+
+task<> serve_pipe (transport_ptr link) {
+   try {
+      co_await serve (*link);
+   }catch (exception& error) {
+      log << link->name() << ": " << error.what() << endl;
+   }
+}
+
+// A fresh pipe with a server on its far end.  Each end of each
+// connection gets its own seed, so faults differ between them but
+// not between runs.
+unique_ptr<cix_connection> open_pipe (const bench_config& conf,
+                                      uint64_t& seed) {
+   auto [client_end, server_end] = memory_pipe();
+   if (conf.faulty) {
+      fault_transport::faults plan = conf.faults;
+      plan.seed = seed++;
+      client_end = make_unique<fault_transport> (move (client_end),
+                                                 plan);
+      plan.seed = seed++;
+      server_end = make_unique<fault_transport> (move (server_end),
+                                                 plan);
+   }
+   scheduler::current()->spawn (serve_pipe (move (server_end)));
+   return make_unique<cix_connection> (move (client_end));
+}
+
+task<> run_op (cix_connection& conn, const string& op,
+               const string& workdir) {
+   if (op == "put") {
+      co_await conn.co_put (workdir + "/source", "bench");
+   }else if (op == "get") {
+      co_await conn.co_get ("bench", workdir + "/copy");
+   }else if (op == "ls") {
+      co_await conn.co_ls();
+   }else if (op == "append") {
+      co_await conn.co_append (workdir + "/record", "bench.log");
+   }else if (op == "rm") {
+      co_await conn.co_rm ("bench");
+   }
+}
+
+// Every connection is closed before returning, which ends its
+// server and lets the scheduler run out of tasks.
+task<> run_client (const bench_config& conf, const string& workdir,
+                   map<string,op_stats>& stats) {
+   uint64_t seed = conf.faults.seed;
+   unique_ptr<cix_connection> conn;
+   for (size_t round = 0; round < conf.rounds; ++round) {
+      for (const string& op: conf.ops) {
+         if (conn == nullptr) conn = open_pipe (conf, seed);
+         clock_type::time_point start = clock_type::now();
+         bool failed = false;
+         try {
+            co_await run_op (*conn, op, workdir);
+         }catch (cix_error& error) {
+            log << op << ": " << error.what() << endl;
+            failed = true;
+         }catch (socket_error& error) {
+            log << op << ": " << error.what() << endl;
+            failed = true;
+         }
+         if (failed) {
+            ++stats[op].failures;
+            if (conn->broken()) conn.reset();
+         }else {
+            stats[op].times.push_back (clock_type::now() - start);
+         }
+      }
+   }
+   conn.reset();
+}
+
+void write_file (const string& path, size_t size) {
+   string data (size, '\0');
+   for (size_t pos = 0; pos < size; ++pos) {
+      data[pos] = static_cast<char> ('a' + pos * 7 % 26);
+   }
+   ofstream out (path, ios::binary);
+   out.write (data.data(), data.size());
+   if (not out.flush()) throw runtime_error (path + ": write failed");
+}
+
+double micros (chrono::nanoseconds time) {
+   return chrono::duration<double, micro> (time).count();
+}
+
+void report (const bench_config& conf, map<string,op_stats>& stats,
+             chrono::nanoseconds elapsed) {
+   cout << left << setw (8) << "op" << right << setw (8) << "count"
+        << setw (8) << "fail" << setw (12) << "mean us"
+        << setw (12) << "p50 us" << setw (12) << "p99 us"
+        << setw (10) << "MB/s" << endl;
+   size_t total = 0;
+   for (const string& op: conf.ops) {
+      op_stats& op_times = stats[op];
+      vector<chrono::nanoseconds>& times = op_times.times;
+      sort (times.begin(), times.end());
+      chrono::nanoseconds sum {0};
+      for (chrono::nanoseconds time: times) sum += time;
+      size_t count = times.size();
+      total += count;
+      auto rank = [&](double fraction) {
+         return count == 0 ? 0.0 : micros (times[min<size_t> (
+                                count - 1, fraction * count)]);
+      };
+      double mean = count == 0 ? 0.0 : micros (sum) / count;
+      cout << left << setw (8) << op << right << setw (8) << count
+           << setw (8) << op_times.failures << fixed
+           << setprecision (1) << setw (12) << mean
+           << setw (12) << rank (0.5) << setw (12) << rank (0.99);
+      if ((op == "put" or op == "get") and sum.count() > 0) {
+         double seconds = chrono::duration<double> (sum).count();
+         cout << setw (10) << count * conf.file_size / seconds / 1e6;
+      }
+      cout << endl;
+   }
+   double seconds = chrono::duration<double> (elapsed).count();
+   cout << total << " operations in " << setprecision (3) << seconds
+        << " s, " << setprecision (0) << total / seconds
+        << " per second" << endl;
+}
+
+vector<string> parse_ops (const string& list) {
+   vector<string> ops;
+   istringstream words (list);
+   for (string op; getline (words, op, ',');) {
+      if (find (known_ops.begin(), known_ops.end(), op)
+          == known_ops.end()) throw invalid_argument ("op " + op);
+      ops.push_back (op);
+   }
+   if (ops.empty()) throw invalid_argument ("no ops");
+   return ops;
+}
+
+void usage() {
+   cerr << "Usage: " << log.execname() << " [-vD] [-n rounds]"
+        << " [-s bytes] [-o put,get,ls,append,rm]"
+        << " [-S none|file|batch] [-l latency-us] [-w bytes-per-sec]"
+        << " [-k max-chunk] [-d drop-rate] [-r seed]" << endl;
+   exit (1);
+}
+
+int main (int argc, char** argv) {
+   log.execname (basename (argv[0]));
+   bench_config conf;
+   write_engine::config write_config;
+   write_config.policy = write_engine::sync_policy::NONE;
+   try {
+      for (;;) {
+         int option = getopt (argc, argv, "vDn:s:o:S:l:w:k:d:r:");
+         if (option == EOF) break;
+         switch (option) {
+            case 'v':
+               log_out.rdbuf (cerr.rdbuf());
+               break;
+            case 'D':
+               conf.dedup = true;
+               break;
+            case 'n':
+               conf.rounds = stoul (optarg);
+               break;
+            case 's':
+               conf.file_size = stoul (optarg);
+               break;
+            case 'o':
+               conf.ops = parse_ops (optarg);
+               break;
+            case 'S':
+               write_config.policy = to_sync_policy (optarg);
+               break;
+            case 'l':
+               conf.faults.latency = chrono::microseconds
+                                     (stoul (optarg));
+               conf.faulty = true;
+               break;
+            case 'w':
+               conf.faults.bandwidth = stod (optarg);
+               conf.faulty = true;
+               break;
+            case 'k':
+               conf.faults.max_chunk = stoul (optarg);
+               conf.faulty = true;
+               break;
+            case 'd':
+               conf.faults.drop_rate = stod (optarg);
+               conf.faulty = true;
+               break;
+            case 'r':
+               conf.faults.seed = stoull (optarg);
+               break;
+            default:
+               throw invalid_argument ("option");
+         }
+      }
+   }catch (logic_error&) {
+      usage();
+   }
+   if (optind != argc) usage();
+
+   const char* tmpdir = getenv ("TMPDIR");
+   string base = tmpdir != nullptr and *tmpdir != '\0'
+               ? tmpdir : "/tmp";
+   base += "/cixbench.XXXXXX";
+   if (mkdtemp (base.data()) == nullptr) {
+      cerr << base << ": " << strerror (errno) << endl;
+      return 1;
+   }
+   int status = 0;
+   try {
+      string workdir = base + "/client";
+      filesystem::create_directory (workdir);
+      filesystem::create_directory (base + "/server");
+      write_file (workdir + "/source", conf.file_size);
+      write_file (workdir + "/record", 100);
+      filesystem::current_path (base + "/server");
+
+      admission admit {admission::config()};
+      limits = &admit;
+      write_engine engine (write_config);
+      writer = &engine;
+      blob_store blobs (BLOB_ROOT, engine, chrono::seconds (0));
+      if (conf.dedup) {
+         int error = blobs.create();
+         if (error != 0) throw runtime_error (strerror (error));
+         store = &blobs;
+      }
+      map<string,op_stats> stats;
+      scheduler sched;
+      sched.spawn (run_client (conf, workdir, stats));
+      clock_type::time_point start = clock_type::now();
+      sched.run();
+      report (conf, stats, clock_type::now() - start);
+   }catch (exception& error) {
+      cerr << log.execname() << ": " << error.what() << endl;
+      status = 1;
+   }
+   filesystem::current_path ("/");
+   filesystem::remove_all (base);
+   return status;
+}
+
@@ -5,7 +5,9 @@
 // CMPS 109
 // Assignment 4
 
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 using namespace std;
@@ -13,187 +15,128 @@ using namespace std;
 #include <libgen.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <fstream>
-#include <sys/stat.h>
 
+#include "admission.h"
+#include "async.h"
+#include "blobstore.h"
 #include "protocol.h"
 #include "logstream.h"
+#include "server.h"
 #include "sockets.h"
+#include "trace.h"
+#include "transport.h"
+#include "writer.h"
 
 logstream log (cout);
 struct cix_exit: public exception {};
 
-void reply_ls (accepted_socket& client_sock, cix_header& header) {
-    const char* ls_cmd = "ls -l 2>&1";
-    FILE* ls_pipe = popen (ls_cmd, "r");
-    if (ls_pipe == NULL) {
-        log << "ls -l: popen failed: " << strerror (errno) << endl;
-        header.command = cix_command::NAK;
-        header.nbytes = errno;
-        send_packet (client_sock, &header, sizeof header);
-        return;
-    }
-    string ls_output;
-    char buffer[0x1000];
-    for (;;) {
-        char* rc = fgets (buffer, sizeof buffer, ls_pipe);
-        if (rc == nullptr) break;
-        ls_output.append (buffer);
-    }
-    int status = pclose (ls_pipe);
-    if (status < 0) log << ls_cmd << ": " << strerror (errno) << endl;
-    else log << ls_cmd << ": exit " << (status >> 8)
-             << " signal " << (status & 0x7F)
-             << " core " << (status >> 7 & 1) << endl;
-    header.command = cix_command::LSOUT;
-    header.nbytes = ls_output.size();
-    memset (header.filename, 0, FILENAME_SIZE);
-    log << "sending header " << header << endl;
-    send_packet (client_sock, &header, sizeof header);
-    send_packet (client_sock, ls_output.c_str(), ls_output.size());
-    log << "sent " << ls_output.size() << " bytes" << endl;
+constexpr auto COLLECT_INTERVAL = chrono::minutes (10);
+constexpr auto COLLECT_PAUSE = chrono::milliseconds (1);
+
+// Garbage blobs are collected by the accepting process while
+// clients are served.  That is safe: a blob linked again while it
+// is being collected keeps the new name, and only drops out of the
+// store, as blobstore.h says.
+void collect_blobs() {
+    if (store == nullptr) return;
+    size_t removed = store->maybe_collect();
+    if (removed > 0) log << "collected " << removed << " blobs" << endl;
 }
 
-void reply_get(accepted_socket& client_sock, cix_header& header)
-{
-    ifstream file(header.filename);
-    if (!file.is_open())
-    {
-        log << "failed to open file" << endl;
-        header.nbytes = errno;
-        header.command = cix_command::NAK;
-        client_sock.send(&header, sizeof(cix_header));
-    }
-    else
-    {
-        struct stat california;
-        if(stat(header.filename, &california) != 0)
-        {
-            header.nbytes = errno;
-            header.command = cix_command::NAK;
-            client_sock.send(&header, sizeof(cix_header));
-            log << "failed to get file state" << endl;
-            file.close();
-            return;
-        }
-        header.command = cix_command::FILEOUT;
-        header.nbytes = california.st_size;
-        char* buffer = new char[header.nbytes];
-        file.read(buffer,header.nbytes);
-        file.close();
-        if (!file)
-        {
-            log << "failed to read enough bytes" << endl;
-            header.nbytes = errno;
-            header.command = cix_command::NAK;
-            client_sock.send(&header, sizeof(cix_header));
-            delete[] buffer;
-            return;
-        }
-        client_sock.send(&header, sizeof(cix_header));
-        log << "sent header" << endl;
-        client_sock.send(buffer, header.nbytes);
-        log << "sent " << header.nbytes << " bytes" << endl;
-        delete[] buffer;
-        // done
-    }
+void run_server (accepted_socket& client_sock) {
+    log.execname (log.execname() + "-server");
+    socket_transport link (client_sock);
+    sync_wait (serve (link));
+    throw cix_exit();
 }
 
-void reply_put(accepted_socket& client_sock, cix_header& header)
-{
-    char* buffer = new char[header.nbytes];
-    if (header.nbytes != 0)
-    {
-        client_sock.recv(buffer, header.nbytes);
+task<> serve_owned (unique_ptr<accepted_socket> client_sock) {
+    try {
+        socket_transport link (*client_sock);
+        co_await serve (link);
+    }catch (exception& error) {
+        log << to_string (*client_sock) << ": " << error.what() << endl;
     }
+    limits->release_connection();
+}
 
-    ofstream file(header.filename);
-    if (!file.is_open())
-    {
-        log << "failed to open file" << endl;
+// Over the connection cap with fail_fast: the client's first
+// request is answered with EAGAIN and the connection closed.
+task<> refuse (accepted_socket& client_sock) {
+    log << "refusing " << to_string (client_sock) << endl;
+    cix_header header;
+    header.command = cix_command::NAK;
+    header.nbytes = EAGAIN;
+    co_await async_send (client_sock, &header, sizeof header);
+}
 
-        header.nbytes = errno;
-        header.command = cix_command::NAK;
-        client_sock.send(&header, sizeof(cix_header));
-        delete[] buffer;
-        return;
+// Queue mode reserves a connection before accepting, leaving
+// further clients in the listen backlog.
+task<bool> admit_connection (server_socket& listener,
+                             accepted_socket& client_sock) {
+    bool queued = not limits->limits().fail_fast;
+    if (queued) {
+        trace_span waiting ("admit");
+        co_await limits->wait_connection();
     }
-    log << "opened file" << endl;
-    file.write(buffer, header.nbytes);
-    delete[] buffer;
-    if (!file)
-    {
-        log << "failed to write file" << endl;
-        header.nbytes = errno;
-        header.command = cix_command::NAK;
-        client_sock.send(&header, sizeof(cix_header));
-        file.close();
-        return;
+    try {
+        trace_span accepting ("accept");
+        co_await async_accept (listener, client_sock);
+    }catch (socket_error&) {
+        if (queued) limits->release_connection();
+        throw;
     }
-    log << "wrote file" << endl;
-    header.command = cix_command::ACK;
-    client_sock.send(&header, sizeof(cix_header));
-    file.close();
+    log << "accepted " << to_string (client_sock) << endl;
+    if (queued or co_await limits->wait_connection()) co_return true;
+    co_await refuse (client_sock);
+    client_sock.close();
+    co_return false;
 }
 
-void reply_rm(accepted_socket& client_sock, cix_header& header)
-{
-
-    if(unlink(header.filename))
-    {
-        log << "failed to remove" << endl;
-        header.nbytes = errno;
-        header.command = cix_command::NAK;
-        client_sock.send(&header, sizeof(cix_header));
-    }
-    else
-    {
-        log << "removed file" << endl;
-        header.command = cix_command::ACK;
-        client_sock.send(&header, sizeof(cix_header));
+// The event loop collects one prefix directory at a time, pausing
+// for its clients in between, rather than stall them all for a
+// scan of the whole store.
+task<> collect_loop() {
+    for (;;) {
+        co_await sleep_for (COLLECT_INTERVAL);
+        size_t removed = 0;
+        for (unsigned prefix = 0; prefix < blob_store::PREFIXES;
+             ++prefix) {
+            removed += store->collect (prefix);
+            co_await sleep_for (COLLECT_PAUSE);
+        }
+        if (removed > 0) {
+            log << "collected " << removed << " blobs" << endl;
+        }
     }
-    log << "some form of acknowledgement" << endl;
 }
 
-
-void run_server (accepted_socket& client_sock) {
-    log.execname (log.execname() + "-server");
-    log << "connected to " << to_string (client_sock) << endl;
-    try {
-        for (;;) {
-            cix_header header;
-            recv_packet (client_sock, &header, sizeof header);
-            log << "received header " << header << endl;
-            switch (header.command) {
-                case cix_command::LS:
-                    reply_ls (client_sock, header);
-                    break;
-                case cix_command::GET:
-                    reply_get(client_sock, header);
-                    break;
-                case cix_command::PUT:
-                    reply_put(client_sock, header);
-                    break;
-                case cix_command::RM:
-                    reply_rm(client_sock, header);
-                    break;
-                default:
-                    log << "invalid header from client:"
-                        << header << endl;
-                    break;
-            }
+// Event driven mode: one thread, one coroutine per connection.
+task<> accept_loop (server_socket& listener) {
+    scheduler* sched = scheduler::current();
+    for (;;) {
+        auto client_sock = make_unique<accepted_socket>();
+        if (not co_await admit_connection (listener, *client_sock)) {
+            continue;
         }
-    }catch (socket_error& error) {
-        log << error.what() << endl;
-    }catch (cix_exit& error) {
-        log << "caught cix_exit" << endl;
+        sched->spawn (serve_owned (move (client_sock)));
     }
-    log << "finishing" << endl;
-    throw cix_exit();
+}
+
+void run_event_server (server_socket& listener) {
+    listener.set_non_blocking (true);
+    scheduler sched;
+    sched.spawn (accept_loop (listener));
+    if (store != nullptr) sched.spawn (collect_loop());
+    sched.run();
 }
 
 void fork_cixserver (server_socket& server, accepted_socket& accept) {
-    pid_t pid = fork();
+    pid_t pid;
+    {
+        trace_span forking ("fork");
+        pid = fork();
+    }
     if (pid == 0) { // child
         server.close();
         run_server (accept);
@@ -201,6 +144,7 @@ void fork_cixserver (server_socket& server, accepted_socket& accept) {
     }else {
         accept.close();
         if (pid < 0) {
+            limits->release_connection();
             log << "fork failed: " << strerror (errno) << endl;
         }else {
             log << "forked cixserver pid " << pid << endl;
@@ -214,6 +158,9 @@ void reap_zombies() {
         int status;
         pid_t child = waitpid (-1, &status, WNOHANG);
         if (child <= 0) break;
+        limits->release_connection();
+        limits->reap (child);
+        writer->reap (child);
         log << "child " << child
             << " exit " << (status >> 8)
             << " signal " << (status & 0x7F)
@@ -240,19 +187,104 @@ void signal_action (int signal, void (*handler) (int)) {
 int main (int argc, char** argv) {
     log.execname (basename (argv[0]));
     log << "starting" << endl;
-    vector<string> args (&argv[1], &argv[argc]);
-    signal_action (SIGCHLD, signal_handler);
-    in_port_t port = get_cix_server_port (args, 0);
+    bool event_mode = false;
+    bool dedup = false;
+    admission::config config;
+    write_engine::config write_config;
+    try {
+        for (;;) {
+            int option = getopt (argc, argv, "edc:t:fr:R:s:S:W:b:a:");
+            if (option == EOF) break;
+            switch (option) {
+                case 'e':
+                    event_mode = true;
+                    break;
+                case 'd':
+                    dedup = true;
+                    break;
+                case 'c':
+                    config.max_connections = stoul (optarg);
+                    break;
+                case 't':
+                    config.max_transfers = stoul (optarg);
+                    break;
+                case 'f':
+                    config.fail_fast = true;
+                    break;
+                case 'r':
+                    config.client_rate = stod (optarg);
+                    break;
+                case 'R':
+                    config.global_rate = stod (optarg);
+                    break;
+                case 's':
+                    config.small_transfer = stoul (optarg);
+                    break;
+                case 'S':
+                    write_config.policy = to_sync_policy (optarg);
+                    break;
+                case 'W':
+                    write_config.batch_window
+                          = chrono::milliseconds (stoul (optarg));
+                    break;
+                case 'b':
+                    write_config.io.bulk_bytes = stoll (optarg);
+                    break;
+                case 'a':
+                    write_config.io.window = stoll (optarg);
+                    break;
+                default:
+                    throw invalid_argument ("option");
+            }
+        }
+    }catch (logic_error&) {
+        cerr << "Usage: " << log.execname() << " [-edf] [-c conns]"
+             << " [-t transfers] [-r client-bps] [-R global-bps]"
+             << " [-s small-bytes] [-S none|file|batch]"
+             << " [-W batch-ms] [-b bulk-bytes] [-a window-bytes]"
+             << " [port | unix:path]" << endl;
+        return 1;
+    }
+    vector<string> args (&argv[optind], &argv[argc]);
+    bool local = not args.empty() and is_unix_address (args[0]);
+    in_port_t port = local ? 0 : get_cix_server_port (args, 0);
+    string address = local ? args[0] : "port " + to_string (port);
+    admission admit (config);
+    limits = &admit;
+    write_engine engine (write_config);
+    writer = &engine;
+    blob_store blobs (BLOB_ROOT, engine, COLLECT_INTERVAL);
+    if (dedup) {
+        int error = blobs.create();
+        if (error != 0) {
+            log << BLOB_ROOT << ": " << strerror (error) << endl;
+            return 1;
+        }
+        store = &blobs;
+        collect_blobs();
+    }
     try {
-        server_socket listener (port);
+        string path = local ? unix_path (args[0]) : "";
+        auto listen_ptr = local ? make_unique<server_socket> (path)
+                                : make_unique<server_socket> (port);
+        server_socket& listener = *listen_ptr;
+        if (event_mode) {
+            log << to_string (hostinfo()) << " accepting "
+                << address << " (event driven)" << endl;
+            run_event_server (listener);
+            throw cix_exit();
+        }
+        signal_action (SIGCHLD, signal_handler);
         for (;;) {
-            log << to_string (hostinfo()) << " accepting port "
-                << to_string (port) << endl;
+            log << to_string (hostinfo()) << " accepting "
+                << address << endl;
             accepted_socket client_sock;
             for (;;) {
                 try {
-                    listener.accept (client_sock);
-                    break;
+                    if (sync_wait (admit_connection (listener,
+                                                     client_sock))) {
+                        break;
+                    }
                 }catch (socket_sys_error& error) {
                     switch (error.sys_errno) {
                         case EINTR:
@@ -264,10 +296,10 @@ int main (int argc, char** argv) {
                     }
                 }
             }
-            log << "accepted " << to_string (client_sock) << endl;
             try {
                 fork_cixserver (listener, client_sock);
                 reap_zombies();
+                collect_blobs();
             }catch (socket_error& error) {
                 log << error.what() << endl;
             }
@@ -0,0 +1,325 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// cluster.cpp
+// cluster file
+// CMPS 109
+// Assignment 4
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <map>
+#include <mutex>
+#include <sstream>
+using namespace std;
+
+#include <unistd.h>
+
+#include "cluster.h"
+#include "sha256.h"
+
+// First 64 bits of the SHA-256, so ring positions do not depend
+// on the platform's std::hash.
+static uint64_t ring_hash (const string& key) {
+    sha256 digest;
+    digest.update (key.data(), key.size());
+    return stoull (digest.hex().substr (0, 16), nullptr, 16);
+}
+
+// Every future is waited for before any result is taken, so no
+// operation is still running when the first failure is rethrown.
+template <typename T>
+static void wait_all (vector<future<T>>& results) {
+    for (future<T>& result: results) result.wait();
+}
+
+// The name is what follows the mode, links, owner, group, size
+// and the three fields of the date; a symlink's target is cut.
+static string entry_name (const string& line) {
+    size_t pos = 0;
+    for (int field = 0; field < 8; ++field) {
+        pos = line.find_first_not_of (' ', pos);
+        if (pos != string::npos) pos = line.find (' ', pos);
+        if (pos == string::npos) return line;
+    }
+    string name = line.substr (pos + 1);
+    size_t arrow = line[0] == 'l' ? name.find (" -> ") : string::npos;
+    return arrow == string::npos ? name : name.substr (0, arrow);
+}
+
+cix_cluster::backend parse_backend (const string& spec) {
+    if (is_unix_address (spec)) return {spec, 0};
+    size_t colon = spec.find_last_of (':');
+    if (colon == string::npos or colon == 0) {
+        throw cix_error (spec + ": expected host:port");
+    }
+    size_t used = 0;
+    unsigned long port = 0;
+    string digits = spec.substr (colon + 1);
+    try {
+        port = stoul (digits, &used);
+    }catch (logic_error&) {
+    }
+    if (used == 0 or used != digits.size() or port > 0xFFFF) {
+        throw cix_error (spec + ": bad port");
+    }
+    return {spec.substr (0, colon), static_cast<in_port_t> (port)};
+}
+
+cix_cluster::cix_cluster (const vector<backend>& backends_,
+                          const options& opts):
+        backends (backends_), replicas (opts.replicas) {
+    if (backends.empty()) throw cix_error ("no servers");
+    if (replicas < 1 or replicas > backends.size()) {
+        throw cix_error ("replicas must be 1 to "
+                         + to_string (backends.size()));
+    }
+    for (size_t index = 0; index < backends.size(); ++index) {
+        const backend& server = backends[index];
+        pools.push_back (make_unique<cix_pool> (server.host,
+                                                server.port,
+                                                opts.pool));
+        string name = server.host + " " + to_string (server.port);
+        for (size_t node = 0; node < opts.virtual_nodes; ++node) {
+            ring.emplace_back (ring_hash (name + "#"
+                                          + to_string (node)), index);
+        }
+    }
+    sort (ring.begin(), ring.end());
+}
+
+vector<size_t> cix_cluster::placement (const string& filename) const {
+    vector<size_t> owners;
+    auto itor = lower_bound (ring.begin(), ring.end(),
+                             make_pair (ring_hash (filename),
+                                        size_t (0)));
+    for (size_t step = 0; step < ring.size()
+                          and owners.size() < replicas; ++step) {
+        if (itor == ring.end()) itor = ring.begin();
+        size_t index = (itor++)->second;
+        if (find (owners.begin(), owners.end(), index)
+            == owners.end()) owners.push_back (index);
+    }
+    return owners;
+}
+
+string cix_cluster::ls() {
+    string listing;
+    auto append = [&listing](const string& chunk) {
+        listing += chunk;
+    };
+    list (cix_connection::list_options(), append);
+    return listing;
+}
+
+// Each backend returns up to limit names past the cursor, so the
+// first limit names of the merge are all within those pages and
+// the last of them is the cursor for the next page.
+string cix_cluster::list (const cix_connection::list_options& query,
+                          cix_connection::list_sink sink) {
+    if (not query.sort.empty() and query.sort != "name") {
+        throw cix_error ("ls: only name order can be merged");
+    }
+    using page = pair<string,string>;
+    vector<future<page>> results;
+    for (unique_ptr<cix_pool>& pool: pools) {
+        results.push_back (pool->async ([query]
+                                        (cix_connection& conn) {
+            string listing;
+            string cursor = conn.list (query,
+                                       [&listing](const string& chunk) {
+                listing += chunk;
+            });
+            return page (listing, cursor);
+        }));
+    }
+    wait_all (results);
+    map<string,string> entries;
+    bool more = false;
+    for (future<page>& result: results) {
+        auto [listing, cursor] = result.get();
+        if (not cursor.empty()) more = true;
+        istringstream lines (listing);
+        for (string line; getline (lines, line);) {
+            entries.emplace (entry_name (line), line);
+        }
+    }
+    size_t limit = query.limit > 0 ? query.limit : entries.size();
+    string merged, last;
+    auto take = [&](auto itor, auto end) {
+        for (size_t count = 0; itor != end and count < limit;
+             ++itor, ++count) {
+            merged += itor->second + "\n";
+            last = itor->first;
+        }
+        if (itor != end) more = true;
+    };
+    if (query.reverse) take (entries.rbegin(), entries.rend());
+    else take (entries.begin(), entries.end());
+    if (not merged.empty()) sink (merged);
+    return more and not last.empty() ? "name:" + last : "";
+}
+
+// Replicas are tried in turn from a rotating start.
+size_t cix_cluster::get (const string& filename,
+                         const string& localpath) {
+    vector<size_t> owners = placement (filename);
+    size_t first = next_read++;
+    for (size_t attempt = 1; ; ++attempt) {
+        size_t index = owners[(first + attempt) % owners.size()];
+        try {
+            return pools[index]->acquire()->get (filename, localpath);
+        }catch (cix_error&) {
+            if (attempt == owners.size()) throw;
+        }catch (socket_error&) {
+            if (attempt == owners.size()) throw;
+        }
+    }
+}
+
+size_t cix_cluster::follow (const string& filename,
+                            const string& localpath,
+                            cix_connection::follow_sink sink) {
+    vector<size_t> owners = placement (filename);
+    size_t index = owners[next_read++ % owners.size()];
+    return pools[index]->acquire()->follow (filename, localpath, sink);
+}
+
+size_t cix_cluster::put (const string& localpath,
+                         const string& filename) {
+    vector<future<size_t>> results;
+    for (size_t index: placement (filename)) {
+        results.push_back (pools[index]->async_put (localpath,
+                                                    filename));
+    }
+    wait_all (results);
+    size_t nbytes = 0;
+    for (future<size_t>& result: results) nbytes = result.get();
+    return nbytes;
+}
+
+size_t cix_cluster::append (const string& localpath,
+                            const string& filename) {
+    vector<future<size_t>> results;
+    for (size_t index: placement (filename)) {
+        results.push_back (pools[index]->async ([=]
+                                                (cix_connection& conn) {
+            return conn.append (localpath, filename);
+        }));
+    }
+    wait_all (results);
+    size_t nbytes = 0;
+    for (future<size_t>& result: results) nbytes = result.get();
+    return nbytes;
+}
+
+size_t cix_cluster::put_range (const string& localpath,
+                               const string& filename,
+                               off_t offset, size_t length) {
+    vector<future<size_t>> results;
+    for (size_t index: placement (filename)) {
+        results.push_back (pools[index]->async ([=]
+                                                (cix_connection& conn) {
+            return conn.put_range (localpath, filename, offset,
+                                   length);
+        }));
+    }
+    wait_all (results);
+    size_t nbytes = 0;
+    for (future<size_t>& result: results) nbytes = result.get();
+    return nbytes;
+}
+
+void cix_cluster::rm (const string& filename) {
+    vector<future<void>> results;
+    for (size_t index: placement (filename)) {
+        results.push_back (pools[index]->async_rm (filename));
+    }
+    wait_all (results);
+    for (future<void>& result: results) result.get();
+}
+
+// Downloads filename and uploads it as target, for a copy between
+// different sets of replicas.
+void cix_cluster::relay (const string& filename, const string& target) {
+    const char* tmpdir = getenv ("TMPDIR");
+    string path = tmpdir != nullptr and *tmpdir != '\0'
+                ? tmpdir : "/tmp";
+    path += "/cix.XXXXXX";
+    int fd = ::mkstemp (path.data());
+    if (fd < 0) throw cix_error (path + ": " + strerror (errno));
+    ::close (fd);
+    try {
+        get (filename, path);
+        put (path, target);
+    }catch (...) {
+        ::unlink (path.c_str());
+        throw;
+    }
+    ::unlink (path.c_str());
+}
+
+static bool same_owners (vector<size_t> left, vector<size_t> right) {
+    sort (left.begin(), left.end());
+    sort (right.begin(), right.end());
+    return left == right;
+}
+
+void cix_cluster::copy (const string& filename, const string& target) {
+    vector<size_t> owners = placement (filename);
+    if (not same_owners (owners, placement (target))) {
+        relay (filename, target);
+        return;
+    }
+    vector<future<void>> results;
+    for (size_t index: owners) {
+        results.push_back (pools[index]->async_copy (filename, target));
+    }
+    wait_all (results);
+    for (future<void>& result: results) result.get();
+}
+
+void cix_cluster::move (const string& filename, const string& target) {
+    vector<size_t> owners = placement (filename);
+    if (not same_owners (owners, placement (target))) {
+        relay (filename, target);
+        rm (filename);
+        return;
+    }
+    vector<future<void>> results;
+    for (size_t index: owners) {
+        results.push_back (pools[index]->async_move (filename, target));
+    }
+    wait_all (results);
+    for (future<void>& result: results) result.get();
+}
+
+// One watch per backend, each on its own thread so the pools'
+// workers stay free.  The first to stop, by sink or by error,
+// makes the others stop at their next batch.
+void cix_cluster::watch (const string& match,
+                         cix_connection::watch_sink sink) {
+    mutex sink_lock;
+    atomic<bool> stopping {false};
+    auto forward = [&](const vector<watch_event>& events) {
+        lock_guard<mutex> guard (sink_lock);
+        if (not stopping and not sink (events)) stopping = true;
+        return not stopping;
+    };
+    vector<future<void>> results;
+    for (unique_ptr<cix_pool>& pool: pools) {
+        auto watch_one = [&, server = pool.get()]() {
+            try {
+                server->acquire()->watch (match, forward);
+            }catch (...) {
+                stopping = true;
+                throw;
+            }
+        };
+        results.push_back (std::async (launch::async, watch_one));
+    }
+    wait_all (results);
+    for (future<void>& result: results) result.get();
+}
@@ -0,0 +1,95 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// cluster.h
+// cluster file
+// CMPS 109
+// Assignment 4
+
+//
+// class cix_cluster
+// one namespace spread over several cixd backends, each reached
+// through its own cix_pool.
+//
+// Filenames are placed on a consistent hash ring with a number of
+// virtual nodes per backend, so adding or removing a backend only
+// moves the files that hashed to it.  A file lives on the first
+// replicas distinct backends clockwise from its hash.
+//
+// put, append, put_range and rm go to every replica in parallel
+// and fail if any replica fails.  get reads from one replica,
+// rotating among them so reads are spread, and falls back to the
+// others if it fails.  copy and move run on the servers when
+// source and destination have the same replicas, and otherwise go
+// through a local temporary file.  list asks every backend in
+// parallel and merges the pages by name, dropping the copies held
+// by other replicas; other sort orders cannot be merged a page at
+// a time and are refused.  watch watches every backend at once and
+// calls sink from one of them at a time; each replica reports a
+// change, so it may be seen more than once.  follow reads from one
+// replica chosen as for get, with no fallback.  Errors are thrown
+// as with cix_connection; a failed connection is dropped by its
+// pool, so a cluster is never broken.
+//
+// parse_backend accepts host:port or unix:path.
+//
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include "libcix.h"
+
+class cix_cluster {
+   public:
+      struct backend {
+         string host;
+         in_port_t port {0};
+      };
+      struct options {
+         size_t replicas {1};
+         size_t virtual_nodes {64};
+         cix_pool::options pool;
+      };
+   private:
+      vector<backend> backends;
+      vector<unique_ptr<cix_pool>> pools;
+      vector<pair<uint64_t,size_t>> ring;
+      size_t replicas;
+      atomic<size_t> next_read {0};
+      void relay (const string& filename, const string& target);
+   public:
+      cix_cluster (const vector<backend>& backends_,
+                   const options& opts);
+      cix_cluster (const cix_cluster&) = delete;
+      cix_cluster& operator= (const cix_cluster&) = delete;
+      vector<size_t> placement (const string& filename) const;
+      string ls();
+      string list (const cix_connection::list_options& query,
+                   cix_connection::list_sink sink);
+      size_t get (const string& filename, const string& localpath);
+      size_t put (const string& localpath, const string& filename);
+      size_t append (const string& localpath, const string& filename);
+      size_t put_range (const string& localpath,
+                        const string& filename, off_t offset,
+                        size_t length);
+      void rm (const string& filename);
+      void copy (const string& filename, const string& target);
+      void move (const string& filename, const string& target);
+      void watch (const string& match,
+                  cix_connection::watch_sink sink);
+      size_t follow (const string& filename, const string& localpath,
+                     cix_connection::follow_sink sink);
+      bool broken() const { return false; }
+};
+
+cix_cluster::backend parse_backend (const string& spec);
+
+#endif
+
@@ -0,0 +1,92 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// extents.cpp
+// extents file
+// CMPS 109
+// Assignment 4
+
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+using namespace std;
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "extents.h"
+
+optional<file_extent> next_extent (int fd, off_t offset, off_t size) {
+    if (offset >= size) return nullopt;
+    off_t data = ::lseek (fd, offset, SEEK_DATA);
+    if (data < 0) {
+        if (errno == ENXIO) return nullopt;
+        return file_extent {offset, size - offset};
+    }
+    if (data >= size) return nullopt;
+    off_t hole = ::lseek (fd, data, SEEK_HOLE);
+    if (hole < 0 or hole > size) hole = size;
+    return file_extent {data, hole - data};
+}
+
+off_t allocated_bytes (const struct stat& stat_buf) {
+    return min<off_t> (stat_buf.st_blocks * 512, stat_buf.st_size);
+}
+
+int copy_extents (int in_fd, int out_fd, off_t size) {
+    bool in_kernel = true;
+    vector<char> buffer;
+    off_t offset = 0;
+    while (auto data = next_extent (in_fd, offset, size)) {
+        off_t in_off = data->offset;
+        off_t out_off = data->offset;
+        while (in_off < data->end()) {
+            size_t count = data->end() - in_off;
+            ssize_t nbytes;
+            if (in_kernel) {
+                nbytes = ::copy_file_range (in_fd, &in_off, out_fd,
+                                            &out_off, count, 0);
+                if (nbytes > 0) continue;
+                if (nbytes == 0) break;
+                if (errno == EINTR) continue;
+                if (errno != EXDEV and errno != ENOSYS
+                    and errno != EINVAL and errno != EOPNOTSUPP) {
+                    return errno;
+                }
+                in_kernel = false;
+                buffer.resize (0x40000);
+            }
+            nbytes = ::pread (in_fd, buffer.data(),
+                              min (count, buffer.size()), in_off);
+            if (nbytes == 0) break;
+            if (nbytes < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            for (ssize_t done = 0; done < nbytes;) {
+                ssize_t nwritten = ::pwrite (out_fd,
+                                             buffer.data() + done,
+                                             nbytes - done,
+                                             in_off + done);
+                if (nwritten < 0) {
+                    if (errno == EINTR) continue;
+                    return errno;
+                }
+                done += nwritten;
+            }
+            in_off += nbytes;
+        }
+        offset = data->end();
+    }
+    return 0;
+}
+
+int copy_file (int in_fd, int out_fd) {
+    if (::ioctl (out_fd, FICLONE, in_fd) == 0) return 0;
+    struct stat stat_buf;
+    if (::fstat (in_fd, &stat_buf) < 0) return errno;
+    int error = copy_extents (in_fd, out_fd, stat_buf.st_size);
+    if (error != 0) return error;
+    return ::ftruncate (out_fd, stat_buf.st_size) < 0 ? errno : 0;
+}
+
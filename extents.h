@@ -0,0 +1,55 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// extents.h
+// extents file
+// CMPS 109
+// Assignment 4
+
+//
+// Sparse file support.
+//
+// struct file_extent
+// one run of data in a file.  Everything between extents, and
+// after the last one up to the file size, is a hole.
+//
+// next_extent returns the first data at or after offset and
+// before size, found with lseek SEEK_DATA and SEEK_HOLE, or
+// nullopt when only holes remain.  A filesystem that cannot
+// report holes makes the whole remainder one extent.
+//
+// allocated_bytes is how much of the file is backed by disk,
+// never more than its size.
+//
+// copy_extents copies the data extents of in_fd below size to the
+// same offsets of out_fd, inside the kernel with copy_file_range
+// where it can, else with pread and pwrite.  copy_file makes
+// out_fd a copy of all of in_fd: a FICLONE reflink if possible,
+// else copy_extents and a truncate that leaves the holes.  Both
+// return 0 or an errno value.
+//
+
+#ifndef __EXTENTS_H__
+#define __EXTENTS_H__
+
+#include <optional>
+using namespace std;
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct file_extent {
+   off_t offset;
+   off_t length;
+   off_t end() const { return offset + length; }
+};
+
+optional<file_extent> next_extent (int fd, off_t offset, off_t size);
+
+off_t allocated_bytes (const struct stat& stat_buf);
+
+int copy_extents (int in_fd, int out_fd, off_t size);
+
+int copy_file (int in_fd, int out_fd);
+
+#endif
+
@@ -0,0 +1,168 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// iopolicy.cpp
+// iopolicy file
+// CMPS 109
+// Assignment 4
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
+using namespace std;
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "async.h"
+#include "iopolicy.h"
+
+static constexpr unsigned WRITE_OUT = SYNC_FILE_RANGE_WAIT_BEFORE
+                                    | SYNC_FILE_RANGE_WRITE
+                                    | SYNC_FILE_RANGE_WAIT_AFTER;
+
+// What the event loop has asked of the helper thread: readahead
+// below target for a read, a wait and a drop below it for a write,
+// or to the end of the file once last is set.  The thread works on
+// a duplicate of the descriptor, so either side may end first.
+struct io_stream::worker {
+   int fd {-1};
+   mutex lock;
+   condition_variable wake;
+   off_t target {0};
+   bool last {false};
+   bool stop {false};
+   ~worker() { if (fd >= 0) ::close (fd); }
+   void post (off_t end, bool to_end);
+   void run (direction way, off_t window);
+};
+
+void io_stream::worker::post (off_t end, bool to_end) {
+    {
+        lock_guard<mutex> guard (lock);
+        target = max (target, end);
+        last = last or to_end;
+    }
+    wake.notify_one();
+}
+
+// Readahead goes a window at a time, as the loop would have.
+void io_stream::worker::run (direction way, off_t window) {
+    unique_lock<mutex> guard (lock);
+    off_t done = 0;
+    for (;;) {
+        wake.wait (guard, [&]() {
+            return stop or last or target > done;
+        });
+        if (stop) return;
+        off_t end = target;
+        bool to_end = last;
+        guard.unlock();
+        if (way == direction::READ) {
+            for (off_t start = done; start < end; start += window) {
+                ::readahead (fd, start, min (window, end - start));
+            }
+        }else {
+            off_t length = to_end ? 0 : end - done;
+            ::sync_file_range (fd, done, length, WRITE_OUT);
+            ::posix_fadvise (fd, done, length, POSIX_FADV_DONTNEED);
+        }
+        guard.lock();
+        done = end;
+        if (to_end) return;
+    }
+}
+
+// Without a scheduler, a descriptor or a thread, there is no
+// helper and everything is done here.
+io_stream::io_stream (int fd_, direction way_, off_t size,
+                      const io_policy& policy):
+        fd (fd_), way (way_), window (max<off_t> (policy.window, 1)),
+        active (policy.bulk_bytes > 0 and size >= policy.bulk_bytes) {
+    if (not active) return;
+    if (scheduler::current() != nullptr) {
+        auto state = make_shared<worker>();
+        state->fd = ::fcntl (fd, F_DUPFD_CLOEXEC, 0);
+        if (state->fd >= 0) {
+            helper = state;
+            try {
+                thread ([state, way_, step = window]() {
+                    state->run (way_, step);
+                }).detach();
+            }catch (system_error&) {
+                helper.reset();
+            }
+        }
+    }
+    if (way != direction::READ) return;
+    ::posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    read_ahead (0, window);
+    ahead = window;
+}
+
+// A stream dropped part way leaves the rest to the kernel.
+io_stream::~io_stream() {
+    if (not helper) return;
+    {
+        lock_guard<mutex> guard (helper->lock);
+        helper->stop = not helper->last;
+    }
+    helper->wake.notify_one();
+}
+
+void io_stream::read_ahead (off_t offset, off_t length) {
+    if (helper) helper->post (offset + length, false);
+    else ::readahead (fd, offset, length);
+}
+
+// Waits for the writeback of the range and drops it; a length of
+// 0 runs to the end of the file.
+void io_stream::write_out (off_t offset, off_t length) {
+    if (helper) {
+        helper->post (offset + length, length == 0);
+        return;
+    }
+    ::sync_file_range (fd, offset, length, WRITE_OUT);
+    ::posix_fadvise (fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+// For reads ahead is how far readahead was asked for; for writes
+// it is how far writeback was started.  Either way the pages below
+// dropped are gone, or soon will be, and at most two windows stay
+// behind ahead.
+void io_stream::advance (off_t offset, size_t length) {
+    if (not active) return;
+    off_t cursor = offset + length;
+    if (way == direction::READ) {
+        ahead = max (ahead, offset);
+        if (cursor + window > ahead) {
+            read_ahead (ahead, window);
+            ahead += window;
+        }
+        if (cursor - dropped > 2 * window) {
+            ::posix_fadvise (fd, dropped, cursor - window - dropped,
+                             POSIX_FADV_DONTNEED);
+            dropped = cursor - window;
+        }
+        return;
+    }
+    while (cursor - ahead >= window) {
+        ::sync_file_range (fd, ahead, window, SYNC_FILE_RANGE_WRITE);
+        ahead += window;
+    }
+    if (ahead - dropped > window) {
+        write_out (dropped, ahead - window - dropped);
+        dropped = ahead - window;
+    }
+}
+
+void io_stream::finish() {
+    if (not active) return;
+    active = false;
+    if (way == direction::WRITE) {
+        write_out (dropped, 0);
+        return;
+    }
+    ::posix_fadvise (fd, dropped, 0, POSIX_FADV_DONTNEED);
+}
@@ -0,0 +1,72 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// iopolicy.h
+// iopolicy file
+// CMPS 109
+// Assignment 4
+
+//
+// struct io_policy
+// how cixd uses the page cache for a transfer, by its size.
+// Transfers under bulk_bytes are left to the kernel, so small hot
+// files stay cached; 0 leaves every transfer alone.  Bulk
+// transfers stream through a window of the cache instead of
+// flooding it:
+//    read   POSIX_FADV_SEQUENTIAL, readahead of the next window
+//           as the cursor enters this one, and POSIX_FADV_DONTNEED
+//           for pages more than a window behind the cursor.
+//    write  sync_file_range starts writeback of each window as it
+//           fills; the window before it is waited for and dropped.
+// Dropping is advisory: pages mapped or still dirty stay cached.
+//
+// class io_stream
+// the policy applied to one descriptor over one transfer.  advance
+// is called after each read or write with the range it covered,
+// in increasing offset order; holes may be skipped.  finish drops
+// what is left, first waiting for the writeback of a written file.
+// A transfer that fails part way need not call it.  Under a
+// scheduler the event loop only starts writeback: readahead, and
+// the waits for writeback before a drop, are left to a thread of
+// the stream's own, which catches up with the latest request.
+//
+
+#ifndef __IOPOLICY_H__
+#define __IOPOLICY_H__
+
+#include <memory>
+using namespace std;
+
+#include <sys/types.h>
+
+struct io_policy {
+   off_t bulk_bytes {16 << 20};
+   off_t window {4 << 20};
+};
+
+class io_stream {
+   public:
+      enum class direction {READ, WRITE};
+   private:
+      struct worker;
+      int fd;
+      direction way;
+      off_t window;
+      bool active;
+      off_t ahead {0};
+      off_t dropped {0};
+      shared_ptr<worker> helper;
+      void read_ahead (off_t offset, off_t length);
+      void write_out (off_t offset, off_t length);
+   public:
+      io_stream (int fd, direction way, off_t size,
+                 const io_policy& policy);
+      io_stream (const io_stream&) = delete;
+      io_stream& operator= (const io_stream&) = delete;
+      ~io_stream();
+      bool bulk() const { return active; }
+      void advance (off_t offset, size_t length);
+      void finish();
+};
+
+#endif
+
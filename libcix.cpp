@@ -0,0 +1,887 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// libcix.cpp
+// libcix file
+// CMPS 109
+// Assignment 4
+
+#include <cerrno>
+#include <climits>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+using namespace std;
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "extents.h"
+#include "libcix.h"
+#include "sha256.h"
+#include "trace.h"
+
+// Smaller files cost less to send than the round trip of asking
+// for them by hash first.
+static constexpr off_t HASH_FIRST_SIZE = 0x10000;
+
+// Closes a descriptor when the coroutine frame or scope ends.
+struct fd_closer {
+   int fd;
+   ~fd_closer() { if (fd >= 0) ::close (fd); }
+   int close() { return ::close (exchange (fd, -1)); }
+};
+
+static cix_error file_error (const string& path, int error) {
+    return cix_error (path + ": " + strerror (error));
+}
+
+static int pwrite_fully (int fd, const char* buffer, size_t bufsize,
+                         off_t offset) {
+    while (bufsize > 0) {
+        ssize_t nbytes = ::pwrite (fd, buffer, bufsize, offset);
+        if (nbytes < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        buffer += nbytes;
+        bufsize -= nbytes;
+        offset += nbytes;
+    }
+    return 0;
+}
+
+// Copies a passed descriptor locally: the data never crosses the
+// socket, and holes stay holes.
+static size_t copy_descriptor (int in_fd, const string& localpath) {
+    struct stat stat_buf;
+    if (::fstat (in_fd, &stat_buf) < 0) {
+        throw file_error (localpath, errno);
+    }
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    fd_closer out {::open (localpath.c_str(), flags, 0666)};
+    if (out.fd < 0) throw file_error (localpath, errno);
+    int error = copy_file (in_fd, out.fd);
+    if (error == 0 and out.close() < 0) error = errno;
+    if (error != 0) throw file_error (localpath, error);
+    return stat_buf.st_size;
+}
+
+
+//
+// cix_connection
+//
+
+cix_connection::cix_connection (const string& host, in_port_t port):
+        socket (make_unique<client_socket> (host, port)),
+        link (make_unique<socket_transport> (*socket)),
+        stream (*link), origin (host + " " + to_string (port)),
+        last_used (chrono::steady_clock::now()) {
+}
+
+cix_connection::cix_connection (transport_ptr link_):
+        link (std::move (link_)), stream (*link),
+        origin (link->name()),
+        last_used (chrono::steady_clock::now()) {
+}
+
+cix_header cix_connection::request (cix_command command,
+                                    const string& filename) {
+    if (filename.size() >= FILENAME_SIZE) {
+        throw cix_error (filename + ": filename too long");
+    }
+    cix_header header;
+    header.command = command;
+    memcpy (header.filename, filename.c_str(), filename.size());
+    return header;
+}
+
+// Id for the span of the next request, 0 when not tracing.
+uint64_t cix_connection::begin_trace() {
+    trace_id = trace_request();
+    return trace_id;
+}
+
+// A traced request is preceded by TRACE with the id of its span,
+// which lets the server's span point back at the client's.
+task<> cix_connection::send_header (cix_header& header) {
+    if (trace_id != 0) {
+        cix_header trace;
+        trace.command = cix_command::TRACE;
+        trace.nbytes = TRACE_ID_SIZE;
+        co_await send_packet (stream, &trace, sizeof trace);
+        co_await send_packet (stream, &trace_id, TRACE_ID_SIZE);
+        trace_id = 0;
+    }
+    co_await send_packet (stream, &header, sizeof header);
+}
+
+// Sends header and body, and replaces header with the server's
+// reply.  A NAK leaves the connection usable.
+task<> cix_connection::exchange_any (cix_header& header,
+                                     const string& body) {
+    broken_ = true;
+    header.nbytes = body.size();
+    co_await send_header (header);
+    co_await send_packet (stream, body.data(), body.size());
+    co_await recv_packet (stream, &header, sizeof header);
+    if (header.command == cix_command::NAK) {
+        broken_ = false;
+        throw cix_nak (header.filename, header.nbytes);
+    }
+}
+
+task<> cix_connection::exchange (cix_header& header,
+                                 cix_command expect,
+                                 const string& body) {
+    co_await exchange_any (header, body);
+    if (header.command != expect) {
+        ostringstream what;
+        what << "unexpected reply " << header;
+        throw cix_error (what.str());
+    }
+}
+
+task<cix_options> cix_connection::recv_options (
+                  const cix_header& header) {
+    if (header.nbytes > MAX_OPTIONS_SIZE) {
+        throw cix_error ("options body too long");
+    }
+    string body (header.nbytes, '\0');
+    co_await recv_packet (stream, body.data(), body.size());
+    co_return decode_options (body);
+}
+
+task<string> cix_connection::co_ls() {
+    string listing;
+    auto append = [&listing](const string& chunk) {
+        listing += chunk;
+    };
+    co_await co_list (list_options(), append);
+    co_return listing;
+}
+
+task<string> cix_connection::co_list (list_options options,
+                                      list_sink sink) {
+    cix_options fields;
+    if (not options.match.empty()) fields["match"] = options.match;
+    if (not options.sort.empty()) fields["sort"] = options.sort;
+    if (options.reverse) fields["reverse"] = "1";
+    if (options.limit > 0) fields["limit"] = to_string (options.limit);
+    if (not options.cursor.empty()) fields["cursor"] = options.cursor;
+    string body = encode_options (fields);
+    if (body.size() > MAX_OPTIONS_SIZE) {
+        throw cix_error ("ls: options too long");
+    }
+    trace_span span ("ls", -1, begin_trace(), trace_flow::OUT);
+    cix_header header = request (cix_command::LIST, options.directory);
+    header.nbytes = body.size();
+    broken_ = true;
+    co_await send_header (header);
+    co_await send_packet (stream, body.data(), body.size());
+    // Any number of LSOUT chunks, possibly none, then LSEND.
+    string chunk;
+    for (;;) {
+        co_await recv_packet (stream, &header, sizeof header);
+        if (header.command == cix_command::NAK) {
+            broken_ = false;
+            string what = options.directory.empty()
+                        ? "ls" : "ls " + options.directory;
+            throw cix_nak (what, header.nbytes);
+        }
+        if (header.command != cix_command::LSOUT
+            and header.command != cix_command::LSEND) {
+            ostringstream what;
+            what << "unexpected reply " << header;
+            throw cix_error (what.str());
+        }
+        chunk.resize (header.nbytes);
+        co_await recv_packet (stream, chunk.data(), chunk.size());
+        if (header.command == cix_command::LSEND) break;
+        sink (chunk);
+    }
+    broken_ = false;
+    co_return chunk;
+}
+
+task<int> cix_connection::co_open (string filename) {
+    trace_span span ("open", -1, begin_trace(), trace_flow::OUT);
+    cix_header header = request (cix_command::GETFD, filename);
+    link->expect_fd();
+    co_await exchange (header, cix_command::FILEFD);
+    int fd = link->take_fd();
+    if (fd < 0) throw cix_error (filename + ": no descriptor passed");
+    broken_ = false;
+    co_return fd;
+}
+
+task<size_t> cix_connection::co_get (string filename,
+                                     string localpath) {
+    if (link->family() == AF_UNIX) {
+        int fd = co_await co_open (filename);
+        try {
+            size_t nbytes = copy_descriptor (fd, localpath);
+            ::close (fd);
+            co_return nbytes;
+        }catch (cix_error&) {
+            ::close (fd);
+            throw;
+        }
+    }
+    trace_span span ("get", -1, begin_trace(), trace_flow::OUT);
+    // With a cache the request carries validators, or an empty
+    // set on a miss so the reply still says what to cache.
+    optional<cix_cache::entry> cached;
+    cix_options validators;
+    if (cache != nullptr) {
+        cached = cache->lookup (origin, filename);
+        validators["cache"] = "1";
+        if (cached) {
+            validators["size"] = cached->size;
+            validators["mtime"] = cached->mtime;
+            validators["sha256"] = cached->sha256;
+        }
+    }
+    // A copy that vanished from the cache since the lookup is
+    // dropped and the file fetched again, unconditionally.
+    cix_header header;
+    cix_options info;
+    for (;;) {
+        header = request (cix_command::SPARSEGET, filename);
+        co_await exchange_any (header, encode_options (validators));
+        if (header.command == cix_command::NOTMOD
+            or header.command == cix_command::FILEINFO) {
+            info = co_await recv_options (header);
+        }
+        if (header.command != cix_command::NOTMOD or not cached) break;
+        broken_ = false;
+        optional<size_t> nbytes = cache->restore (origin, filename,
+                                                  localpath);
+        if (nbytes) {
+            cached->mtime = info["mtime"];
+            cache->refresh (origin, filename, *cached);
+            co_return *nbytes;
+        }
+        cache->forget (origin, filename);
+        cached.reset();
+        validators = {{"cache", "1"}};
+        info.clear();
+    }
+    if (header.command == cix_command::FILEINFO) {
+        co_await recv_packet (stream, &header, sizeof header);
+    }
+    if (header.command != cix_command::SPARSEOUT) {
+        ostringstream what;
+        what << "unexpected reply " << header;
+        throw cix_error (what.str());
+    }
+    if (filename != header.filename) {
+        throw cix_error (filename + ": filename mismatch "
+                         + header.filename);
+    }
+    // A local failure still drains the body to keep the connection.
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    fd_closer file {::open (localpath.c_str(), flags, 0666)};
+    int error = file.fd < 0 ? errno : 0;
+    vector<char> buffer (sockbuf::BUFSIZE);
+    sparse_record record;
+    for (;;) {
+        co_await recv_packet (stream, &record, sizeof record);
+        if (record.length == 0) break;
+        for (uint64_t pos = record.offset, end = pos + record.length;
+             pos < end;) {
+            size_t nbytes = min<uint64_t> (end - pos, buffer.size());
+            co_await recv_packet (stream, buffer.data(), nbytes);
+            if (error == 0) {
+                error = pwrite_fully (file.fd, buffer.data(), nbytes,
+                                      pos);
+            }
+            pos += nbytes;
+        }
+    }
+    broken_ = false;
+    if (error == 0 and (::ftruncate (file.fd, record.offset) < 0
+                        or file.close() < 0)) {
+        error = errno;
+    }
+    if (error != 0) throw file_error (localpath, error);
+    if (cache != nullptr and not info.empty()) {
+        cache->store (origin, filename, localpath,
+                      {info["size"], info["mtime"], ""});
+    }
+    co_return record.offset;
+}
+
+// Asks the server to make filename from contents it already
+// holds, and returns false if it holds none.  A server that does
+// not store by content is not asked again on this connection.
+task<bool> cix_connection::put_hash (int fd, off_t size,
+                                     string filename) {
+    string hash = sha256_file (fd);
+    if (hash.empty()) co_return false;
+    cix_header header = request (cix_command::PUTHASH, filename);
+    string body = encode_options ({{"sha256", hash},
+                                   {"size", to_string (size)}});
+    try {
+        co_await exchange (header, cix_command::ACK, body);
+    }catch (cix_nak& nak) {
+        if (nak.sys_errno == EOPNOTSUPP) hash_first = false;
+        else if (nak.sys_errno != ENOENT) throw;
+        co_return false;
+    }
+    broken_ = false;
+    co_return true;
+}
+
+// Only the data extents of the file are read and sent.  A sparse
+// file is not offered by hash, since hashing it would read all of
+// its holes.
+task<size_t> cix_connection::co_put (string localpath,
+                                     string filename) {
+    trace_span span ("put", -1, begin_trace(), trace_flow::OUT);
+    cix_header header = request (cix_command::SPARSEPUT, filename);
+    fd_closer file {::open (localpath.c_str(), O_RDONLY | O_CLOEXEC)};
+    struct stat stat_buf;
+    if (file.fd < 0 or ::fstat (file.fd, &stat_buf) != 0) {
+        throw file_error (localpath, errno);
+    }
+    if (not S_ISREG (stat_buf.st_mode)) {
+        throw cix_error (localpath + ": not a regular file");
+    }
+    off_t size = stat_buf.st_size;
+    if (hash_first and size >= HASH_FIRST_SIZE
+        and allocated_bytes (stat_buf) == size
+        and co_await put_hash (file.fd, size, filename)) {
+        co_return size;
+    }
+    header.nbytes = min<off_t> (allocated_bytes (stat_buf),
+                                UINT32_MAX);
+    vector<char> buffer (sockbuf::BUFSIZE);
+    broken_ = true;
+    co_await send_header (header);
+    off_t offset = 0;
+    while (auto data = next_extent (file.fd, offset, size)) {
+        sparse_record record;
+        record.offset = data->offset;
+        record.length = data->length;
+        co_await send_packet (stream, &record, sizeof record);
+        for (off_t pos = data->offset; pos < data->end();) {
+            size_t nbytes = min<off_t> (data->end() - pos,
+                                        buffer.size());
+            if (::pread (file.fd, buffer.data(), nbytes, pos)
+                != static_cast<ssize_t> (nbytes)) {
+                throw cix_error (localpath + ": short read");
+            }
+            co_await send_packet (stream, buffer.data(), nbytes);
+            pos += nbytes;
+        }
+        offset = data->end();
+    }
+    sparse_record last;
+    last.offset = size;
+    co_await send_packet (stream, &last, sizeof last);
+    co_await recv_packet (stream, &header, sizeof header);
+    if (header.command == cix_command::NAK) {
+        broken_ = false;
+        throw cix_nak (filename, header.nbytes);
+    }
+    if (header.command != cix_command::ACK) {
+        throw cix_error ("PUT: server did not return ACK");
+    }
+    broken_ = false;
+    co_return size;
+}
+
+task<> cix_connection::co_rm (string filename) {
+    trace_span span ("rm", -1, begin_trace(), trace_flow::OUT);
+    cix_header header = request (cix_command::RM, filename);
+    co_await exchange (header, cix_command::ACK);
+    broken_ = false;
+}
+
+// One APPEND or PUTRANGE; offset is ignored for APPEND.
+task<> cix_connection::update (cix_command command, string filename,
+                               off_t offset, string data) {
+    string body;
+    if (command == cix_command::PUTRANGE) {
+        sparse_record range;
+        range.offset = offset;
+        range.length = data.size();
+        body.assign (reinterpret_cast<const char*> (&range),
+                     sizeof range);
+    }
+    body += data;
+    cix_header header = request (command, filename);
+    co_await exchange (header, cix_command::ACK, body);
+    broken_ = false;
+}
+
+// Sends length bytes of localpath from offset, or up to its end,
+// in requests the server accepts.  An empty range still sends one
+// request, so the remote file is created.
+task<size_t> cix_connection::send_range (cix_command command,
+                                         string localpath,
+                                         string filename,
+                                         off_t offset, size_t length) {
+    fd_closer file {::open (localpath.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (file.fd < 0) throw file_error (localpath, errno);
+    size_t sent = 0;
+    for (;;) {
+        string data (min (length - sent, MAX_UPDATE_SIZE), '\0');
+        ssize_t nbytes = ::pread (file.fd, data.data(), data.size(),
+                                  offset + sent);
+        if (nbytes < 0) throw file_error (localpath, errno);
+        if (nbytes == 0 and sent > 0) break;
+        data.resize (nbytes);
+        co_await update (command, filename, offset + sent, data);
+        sent += nbytes;
+        if (nbytes == 0 or sent == length) break;
+    }
+    co_return sent;
+}
+
+task<size_t> cix_connection::co_append (string localpath,
+                                        string filename) {
+    trace_span span ("append", -1, begin_trace(), trace_flow::OUT);
+    co_return co_await send_range (cix_command::APPEND, localpath,
+                                   filename, 0, SIZE_MAX);
+}
+
+task<size_t> cix_connection::co_put_range (string localpath,
+                                           string filename,
+                                           off_t offset,
+                                           size_t length) {
+    trace_span span ("put range", -1, begin_trace(), trace_flow::OUT);
+    if (offset < 0) throw cix_error ("put: negative offset");
+    co_return co_await send_range (cix_command::PUTRANGE, localpath,
+                                   filename, offset,
+                                   length > 0 ? length : SIZE_MAX);
+}
+
+// The destination travels as the body; request checks its length.
+task<> cix_connection::relocate (cix_command command, string filename,
+                                 string target) {
+    if (target.empty()) throw cix_error ("missing destination");
+    request (command, target);
+    cix_header header = request (command, filename);
+    co_await exchange (header, cix_command::ACK, target);
+    broken_ = false;
+}
+
+task<> cix_connection::co_copy (string filename, string target) {
+    trace_span span ("copy", -1, begin_trace(), trace_flow::OUT);
+    co_await relocate (cix_command::COPY, filename, target);
+}
+
+task<> cix_connection::co_move (string filename, string target) {
+    trace_span span ("move", -1, begin_trace(), trace_flow::OUT);
+    co_await relocate (cix_command::MOVE, filename, target);
+}
+
+// The server keeps sending until it sees the ACK that stops the
+// watch, then answers it with ACK.
+task<> cix_connection::co_watch (string match, watch_sink sink) {
+    trace_span span ("watch", -1, begin_trace(), trace_flow::OUT);
+    cix_options fields;
+    if (not match.empty()) fields["match"] = match;
+    string body = encode_options (fields);
+    if (body.size() > MAX_OPTIONS_SIZE) {
+        throw cix_error ("watch: options too long");
+    }
+    cix_header header = request (cix_command::WATCH, "");
+    co_await exchange (header, cix_command::ACK, body);
+    bool watching = true;
+    string events;
+    for (;;) {
+        co_await recv_packet (stream, &header, sizeof header);
+        if (header.command == cix_command::ACK and not watching) break;
+        if (header.command != cix_command::EVENT
+            or header.nbytes > MAX_EVENT_SIZE) {
+            ostringstream what;
+            what << "unexpected reply " << header;
+            throw cix_error (what.str());
+        }
+        events.resize (header.nbytes);
+        co_await recv_packet (stream, events.data(), events.size());
+        if (watching and not sink (decode_events (events))) {
+            watching = false;
+            cix_header stop;
+            stop.command = cix_command::ACK;
+            co_await send_packet (stream, &stop, sizeof stop);
+            co_await stream.flush();
+        }
+    }
+    broken_ = false;
+}
+
+// Like watch, stopped by an ACK the server answers with ACK.  A
+// local write failure stops following and is thrown once the
+// connection is back in step.
+task<size_t> cix_connection::co_follow (string filename,
+                                        string localpath,
+                                        follow_sink sink) {
+    trace_span span ("follow", -1, begin_trace(), trace_flow::OUT);
+    cix_header header = request (cix_command::FOLLOW, filename);
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    fd_closer file {::open (localpath.c_str(), flags, 0666)};
+    if (file.fd < 0) throw file_error (localpath, errno);
+    co_await exchange (header, cix_command::ACK);
+    bool following = true;
+    int error = 0;
+    off_t size = 0;
+    vector<char> buffer (sockbuf::BUFSIZE);
+    for (;;) {
+        co_await recv_packet (stream, &header, sizeof header);
+        if (header.command == cix_command::ACK and not following) break;
+        bool restarted = header.command == cix_command::TRUNC;
+        if (not restarted and header.command != cix_command::TAILOUT) {
+            ostringstream what;
+            what << "unexpected reply " << header;
+            throw cix_error (what.str());
+        }
+        if (restarted and error == 0) {
+            size = 0;
+            if (::ftruncate (file.fd, 0) < 0) error = errno;
+        }
+        for (size_t pos = 0; pos < header.nbytes;) {
+            size_t nbytes = min<size_t> (header.nbytes - pos,
+                                         buffer.size());
+            co_await recv_packet (stream, buffer.data(), nbytes);
+            if (error == 0) {
+                error = pwrite_fully (file.fd, buffer.data(), nbytes,
+                                      size);
+            }
+            size += nbytes;
+            pos += nbytes;
+        }
+        if (following and (error != 0 or not sink (size, restarted))) {
+            following = false;
+            cix_header stop;
+            stop.command = cix_command::ACK;
+            co_await send_packet (stream, &stop, sizeof stop);
+            co_await stream.flush();
+        }
+    }
+    broken_ = false;
+    if (error == 0 and file.close() < 0) error = errno;
+    if (error != 0) throw file_error (localpath, error);
+    co_return size;
+}
+
+string cix_connection::ls() {
+    return sync_wait (co_ls());
+}
+
+string cix_connection::list (const list_options& options,
+                             list_sink sink) {
+    return sync_wait (co_list (options, sink));
+}
+
+int cix_connection::open (const string& filename) {
+    return sync_wait (co_open (filename));
+}
+
+size_t cix_connection::get (const string& filename,
+                            const string& localpath) {
+    return sync_wait (co_get (filename, localpath));
+}
+
+size_t cix_connection::put (const string& localpath,
+                            const string& filename) {
+    return sync_wait (co_put (localpath, filename));
+}
+
+void cix_connection::rm (const string& filename) {
+    sync_wait (co_rm (filename));
+}
+
+size_t cix_connection::append (const string& localpath,
+                               const string& filename) {
+    return sync_wait (co_append (localpath, filename));
+}
+
+size_t cix_connection::put_range (const string& localpath,
+                                  const string& filename,
+                                  off_t offset, size_t length) {
+    return sync_wait (co_put_range (localpath, filename, offset,
+                                    length));
+}
+
+void cix_connection::copy (const string& filename,
+                           const string& target) {
+    sync_wait (co_copy (filename, target));
+}
+
+void cix_connection::move (const string& filename,
+                           const string& target) {
+    sync_wait (co_move (filename, target));
+}
+
+// An idle connection must have nothing buffered and nothing
+// arriving; readable here means the server closed or misbehaved.
+bool cix_connection::healthy() {
+    if (broken_) return false;
+    if (stream.available() > 0 or stream.pending() > 0) return false;
+    return not link->readable (0);
+}
+
+chrono::steady_clock::duration cix_connection::idle_time() const {
+    return chrono::steady_clock::now() - last_used;
+}
+
+void cix_connection::watch (const string& match, watch_sink sink) {
+    sync_wait (co_watch (match, sink));
+}
+
+size_t cix_connection::follow (const string& filename,
+                               const string& localpath,
+                               follow_sink sink) {
+    return sync_wait (co_follow (filename, localpath, sink));
+}
+
+string to_string (const cix_connection& conn) {
+    return conn.link->name();
+}
+
+
+//
+// cix_pool
+//
+
+cix_pool::cix_pool (const string& host_, in_port_t port_):
+        cix_pool (host_, port_, options()) {
+}
+
+cix_pool::cix_pool (const string& host_, in_port_t port_,
+                    options opts_):
+        host (host_), port (port_), opts (opts_) {
+    for (size_t count = 0; count < opts.workers; ++count) {
+        workers.emplace_back (&cix_pool::worker, this);
+    }
+}
+
+cix_pool::~cix_pool() {
+    {
+        lock_guard<mutex> guard (work_lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (thread& worker: workers) worker.join();
+}
+
+cix_pool::lease cix_pool::acquire() {
+    connection_ptr conn;
+    vector<connection_ptr> stale;
+    {
+        lock_guard<mutex> guard (idle_lock);
+        while (not idle.empty() and not conn) {
+            connection_ptr candidate = move (idle.back());
+            idle.pop_back();
+            if (candidate->idle_time() < opts.idle_timeout
+                and candidate->healthy()) {
+                conn = move (candidate);
+            }else {
+                stale.push_back (move (candidate));
+            }
+        }
+    }
+    if (not conn) conn = make_unique<cix_connection> (host, port);
+    return lease (this, move (conn));
+}
+
+void cix_pool::release (connection_ptr conn) {
+    if (conn->broken()) return;
+    conn->last_used = chrono::steady_clock::now();
+    lock_guard<mutex> guard (idle_lock);
+    if (idle.size() < opts.max_idle) idle.push_back (move (conn));
+}
+
+size_t cix_pool::idle_count() {
+    lock_guard<mutex> guard (idle_lock);
+    return idle.size();
+}
+
+void cix_pool::submit (function<void()> job) {
+    {
+        lock_guard<mutex> guard (work_lock);
+        work.push_back (move (job));
+    }
+    work_ready.notify_one();
+}
+
+void cix_pool::worker() {
+    for (;;) {
+        function<void()> job;
+        {
+            unique_lock<mutex> guard (work_lock);
+            work_ready.wait (guard, [this]() {
+                return stopping or not work.empty();
+            });
+            if (work.empty()) return;
+            job = move (work.front());
+            work.pop_front();
+        }
+        job();
+    }
+}
+
+future<string> cix_pool::async_ls() {
+    return async ([](cix_connection& conn) { return conn.ls(); });
+}
+
+future<size_t> cix_pool::async_get (const string& filename,
+                                    const string& localpath) {
+    return async ([filename, localpath](cix_connection& conn) {
+        return conn.get (filename, localpath);
+    });
+}
+
+future<size_t> cix_pool::async_put (const string& localpath,
+                                    const string& filename) {
+    return async ([localpath, filename](cix_connection& conn) {
+        return conn.put (localpath, filename);
+    });
+}
+
+future<void> cix_pool::async_rm (const string& filename) {
+    return async ([filename](cix_connection& conn) {
+        conn.rm (filename);
+    });
+}
+
+future<void> cix_pool::async_copy (const string& filename,
+                                   const string& target) {
+    return async ([filename, target](cix_connection& conn) {
+        conn.copy (filename, target);
+    });
+}
+
+future<void> cix_pool::async_move (const string& filename,
+                                   const string& target) {
+    return async ([filename, target](cix_connection& conn) {
+        conn.move (filename, target);
+    });
+}
+
+
+//
+// cix_cache
+//
+
+static bool make_directories (const string& path) {
+    for (size_t slash = path.find ('/', 1); ;
+         slash = path.find ('/', slash + 1)) {
+        string prefix = path.substr (0, slash);
+        if (::mkdir (prefix.c_str(), 0700) < 0 and errno != EEXIST) {
+            return false;
+        }
+        if (slash == string::npos) return true;
+    }
+}
+
+cix_cache::cix_cache (const string& root_): root (root_) {
+    if (not make_directories (root)) throw file_error (root, errno);
+}
+
+string cix_cache::default_root() {
+    const char* env = getenv ("CIX_CACHE");
+    if (env != nullptr and *env != '\0') return env;
+    env = getenv ("XDG_CACHE_HOME");
+    if (env != nullptr and *env != '\0') return string (env) + "/cix";
+    env = getenv ("HOME");
+    if (env != nullptr and *env != '\0') {
+        return string (env) + "/.cache/cix";
+    }
+    return "";
+}
+
+string cix_cache::base (const string& origin,
+                        const string& filename) const {
+    sha256 key;
+    string name = origin + "\n" + filename;
+    key.update (name.data(), name.size());
+    return root + "/" + key.hex();
+}
+
+bool cix_cache::write_meta (const string& base_, const entry& meta) {
+    string body = encode_options ({{"size", meta.size},
+                                   {"mtime", meta.mtime},
+                                   {"sha256", meta.sha256}});
+    string path = base_ + ".meta";
+    string temp = path + "." + to_string (::getpid());
+    ofstream file (temp, ios::trunc);
+    file << body;
+    file.close();
+    if (file and ::rename (temp.c_str(), path.c_str()) == 0) return true;
+    ::unlink (temp.c_str());
+    return false;
+}
+
+// An entry is only trusted if its data file is still there and
+// still the size the server reported; one that is not is removed.
+optional<cix_cache::entry> cix_cache::lookup (const string& origin,
+                                              const string& filename) {
+    string path = base (origin, filename);
+    ifstream file (path + ".meta");
+    if (not file) return nullopt;
+    string body ((istreambuf_iterator<char> (file)),
+                 istreambuf_iterator<char>());
+    cix_options meta = decode_options (body);
+    struct stat stat_buf;
+    if (meta["sha256"].empty()
+        or ::stat ((path + ".data").c_str(), &stat_buf) != 0
+        or to_string (stat_buf.st_size) != meta["size"]) {
+        forget (origin, filename);
+        return nullopt;
+    }
+    return entry {meta["size"], meta["mtime"], meta["sha256"]};
+}
+
+void cix_cache::store (const string& origin, const string& filename,
+                       const string& localpath, const entry& meta) {
+    string path = base (origin, filename);
+    string temp = path + ".data." + to_string (::getpid());
+    fd_closer in {::open (localpath.c_str(), O_RDONLY | O_CLOEXEC)};
+    fd_closer out {::open (temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC
+                                         | O_CLOEXEC, 0600)};
+    entry hashed = meta;
+    if (in.fd >= 0 and out.fd >= 0) hashed.sha256 = sha256_file (in.fd);
+    if (hashed.sha256.empty() or copy_file (in.fd, out.fd) != 0
+        or out.close() < 0
+        or ::rename (temp.c_str(), (path + ".data").c_str()) < 0
+        or not write_meta (path, hashed)) {
+        ::unlink (temp.c_str());
+        ::unlink ((path + ".meta").c_str());
+    }
+}
+
+void cix_cache::refresh (const string& origin, const string& filename,
+                         const entry& meta) {
+    write_meta (base (origin, filename), meta);
+}
+
+void cix_cache::forget (const string& origin,
+                        const string& filename) {
+    string path = base (origin, filename);
+    ::unlink ((path + ".meta").c_str());
+    ::unlink ((path + ".data").c_str());
+}
+
+// Only a failure to write localpath is an error; a missing copy
+// is simply not restored.
+optional<size_t> cix_cache::restore (const string& origin,
+                                     const string& filename,
+                                     const string& localpath) {
+    string data = base (origin, filename) + ".data";
+    fd_closer in {::open (data.c_str(), O_RDONLY | O_CLOEXEC)};
+    struct stat stat_buf;
+    if (in.fd < 0 or ::fstat (in.fd, &stat_buf) < 0) return nullopt;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    fd_closer out {::open (localpath.c_str(), flags, 0666)};
+    if (out.fd < 0) throw file_error (localpath, errno);
+    int error = copy_file (in.fd, out.fd);
+    if (error == 0 and out.close() < 0) error = errno;
+    if (error != 0) throw file_error (localpath, error);
+    return stat_buf.st_size;
+}
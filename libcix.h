@@ -0,0 +1,298 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// libcix.h
+// libcix file
+// CMPS 109
+// Assignment 4
+
+//
+// libcix: embeddable cix client.
+// Results are returned to the caller, never logged or printed.
+// A server NAK is thrown as cix_nak carrying the server's errno,
+// a malformed reply as cix_error, and transport failures as the
+// usual socket_error.  A NAK leaves the connection usable; any
+// other exception marks it broken and it should be discarded.
+//
+// class cix_connection
+// one persistent connection, one operation at a time
+//
+// class cix_cache
+// local copies of fetched files, for conditional gets
+//
+// class cix_pool
+// thread-safe pool of warm cix_connections with health checks,
+// plus worker threads running async operations that return
+// futures or invoke a completion callback
+//
+
+#ifndef __LIBCIX_H__
+#define __LIBCIX_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include "async.h"
+#include "protocol.h"
+#include "sockbuf.h"
+#include "sockets.h"
+#include "transport.h"
+
+class cix_error: public runtime_error {
+   public:
+      explicit cix_error (const string& what): runtime_error (what) {}
+};
+
+class cix_nak: public cix_error {
+   public:
+      int sys_errno;
+      cix_nak (const string& what, int errno_):
+               cix_error (what + ": " + strerror (errno_)),
+               sys_errno (errno_) {}
+};
+
+class cix_cache {
+   public:
+      // What the server reported of a cached file.
+      struct entry {
+         string size;
+         string mtime;
+         string sha256;
+      };
+   private:
+      const string root;
+      string base (const string& origin, const string& filename) const;
+      bool write_meta (const string& base, const entry& meta);
+   public:
+      explicit cix_cache (const string& root);
+      // $CIX_CACHE, else $XDG_CACHE_HOME/cix or ~/.cache/cix.
+      // Nothing is ever evicted, so cix only keeps a cache when
+      // asked to, with -c or $CIX_CACHE.
+      static string default_root();
+      optional<entry> lookup (const string& origin,
+                              const string& filename);
+      // Failures are not errors; the copy is simply not cached.
+      void store (const string& origin, const string& filename,
+                  const string& localpath, const entry& meta);
+      void refresh (const string& origin, const string& filename,
+                    const entry& meta);
+      // nullopt if the copy has gone, for the caller to forget it
+      // and fetch the file again.
+      optional<size_t> restore (const string& origin,
+                                const string& filename,
+                                const string& localpath);
+      void forget (const string& origin, const string& filename);
+};
+
+class cix_connection {
+   public:
+      // Empty fields take the server's defaults.
+      struct list_options {
+         string directory;
+         string match;
+         string sort;
+         bool reverse {false};
+         size_t limit {0};
+         string cursor;
+      };
+      using list_sink = function<void (const string&)>;
+      using watch_sink = function<bool (const vector<watch_event>&)>;
+      using follow_sink = function<bool (size_t size, bool restarted)>;
+   private:
+      unique_ptr<client_socket> socket;
+      transport_ptr link;
+      sockbuf stream;
+      const string origin;
+      cix_cache* cache {nullptr};
+      bool broken_ {false};
+      bool hash_first {true};
+      chrono::steady_clock::time_point last_used;
+      uint64_t trace_id {0};
+      uint64_t begin_trace();
+      cix_header request (cix_command command, const string& filename);
+      task<> send_header (cix_header& header);
+      task<> exchange_any (cix_header& header, const string& body);
+      task<> exchange (cix_header& header, cix_command expect,
+                       const string& body = "");
+      task<cix_options> recv_options (const cix_header& header);
+      task<> relocate (cix_command command, string filename,
+                       string target);
+      task<> update (cix_command command, string filename,
+                     off_t offset, string data);
+      task<size_t> send_range (cix_command command, string localpath,
+                               string filename, off_t offset,
+                               size_t length);
+      task<bool> put_hash (int fd, off_t size, string filename);
+   public:
+      cix_connection (const string& host, in_port_t port);
+      // Over any transport, such as a memory_pipe to a server in
+      // the same process.
+      explicit cix_connection (transport_ptr link_);
+      // The operations as coroutines, to co_await under a
+      // scheduler.
+      task<string> co_ls();
+      // One page of a listing, streamed to sink a chunk at a time
+      // as it arrives, where co_ls returns a whole listing.  The
+      // cursor returned for the next page is empty at the end.
+      task<string> co_list (list_options options, list_sink sink);
+      // Unix socket only: a read-only descriptor for the remote
+      // file, passed by the server.  The caller closes it.
+      task<int> co_open (string filename);
+      // Over a Unix socket, copies from the descriptor co_open
+      // returns instead of the socket.  Otherwise only the data
+      // extents are sent, so holes are recreated and sizes are
+      // not limited to 32 bits.  Conditional with a cache.
+      task<size_t> co_get (string filename, string localpath);
+      // Sends only the data extents, as co_get does.  A large
+      // file is first offered by its SHA-256: a server storing
+      // by content that holds it already needs no data.
+      task<size_t> co_put (string localpath, string filename);
+      task<> co_rm (string filename);
+      // co_append adds localpath to the end of the remote file,
+      // co_put_range writes length bytes at offset (0: to its
+      // end) into the same range.  Both create the remote file
+      // if need be and return the bytes sent.  Each piece of
+      // MAX_UPDATE_SIZE bytes is atomic against other appends; a
+      // larger append as a whole is not.
+      task<size_t> co_append (string localpath, string filename);
+      task<size_t> co_put_range (string localpath, string filename,
+                                 off_t offset, size_t length);
+      // Run entirely on the server.
+      task<> co_copy (string filename, string target);
+      task<> co_move (string filename, string target);
+      // Hands change events to sink a batch at a time, with an
+      // empty batch now and then while nothing changes, until
+      // sink returns false; events still in flight are dropped.
+      task<> co_watch (string match, watch_sink sink);
+      // co_get, then appends whatever the server's copy gains,
+      // calling sink with the local size after each batch and
+      // now and then while idle, until sink returns false.
+      // restarted says the file was truncated or rotated and the
+      // local copy started over.
+      task<size_t> co_follow (string filename, string localpath,
+                              follow_sink sink);
+      // Each runs its coroutine to completion with sync_wait, so
+      // none may be called on a thread running a scheduler.
+      string ls();
+      string list (const list_options& options, list_sink sink);
+      int open (const string& filename);
+      size_t get (const string& filename, const string& localpath);
+      size_t put (const string& localpath, const string& filename);
+      void rm (const string& filename);
+      size_t append (const string& localpath, const string& filename);
+      size_t put_range (const string& localpath,
+                        const string& filename, off_t offset,
+                        size_t length);
+      void copy (const string& filename, const string& target);
+      void move (const string& filename, const string& target);
+      void watch (const string& match, watch_sink sink);
+      size_t follow (const string& filename, const string& localpath,
+                     follow_sink sink);
+      // get is then conditional: a file the server reports
+      // unchanged is copied out of the cache in one round trip.
+      void use_cache (cix_cache* cache_) { cache = cache_; }
+      bool broken() const { return broken_; }
+      bool healthy();
+      chrono::steady_clock::duration idle_time() const;
+      friend string to_string (const cix_connection&);
+      friend class cix_pool;
+};
+
+class cix_pool {
+   public:
+      using connection_ptr = unique_ptr<cix_connection>;
+      class lease {
+         private:
+            cix_pool* pool;
+            connection_ptr conn;
+         public:
+            lease (cix_pool* pool_, connection_ptr conn_):
+                   pool (pool_), conn (move (conn_)) {}
+            lease (lease&&) = default;
+            ~lease() { if (conn) pool->release (move (conn)); }
+            cix_connection* operator->() { return conn.get(); }
+            cix_connection& operator*() { return *conn; }
+      };
+      struct options {
+         size_t workers {4};
+         size_t max_idle {8};
+         chrono::seconds idle_timeout {60};
+      };
+   private:
+      const string host;
+      const in_port_t port;
+      const options opts;
+      mutex idle_lock;
+      vector<connection_ptr> idle;
+      mutex work_lock;
+      condition_variable work_ready;
+      deque<function<void()>> work;
+      vector<thread> workers;
+      bool stopping {false};
+      void release (connection_ptr conn);
+      void worker();
+      void submit (function<void()> job);
+   public:
+      cix_pool (const string& host, in_port_t port);
+      cix_pool (const string& host, in_port_t port, options opts);
+      cix_pool (const cix_pool&) = delete;
+      cix_pool& operator= (const cix_pool&) = delete;
+      ~cix_pool();
+      lease acquire();
+      size_t idle_count();
+
+      // Runs fn (cix_connection&) on a worker with a leased
+      // connection and returns a future for its result.
+      template <typename F>
+      auto async (F fn) -> future<decltype (fn (declval
+                                    <cix_connection&>()))> {
+         using R = decltype (fn (declval<cix_connection&>()));
+         auto task = make_shared<packaged_task<R()>> (
+            [this, fn = move (fn)]() {
+               lease conn = acquire();
+               return fn (*conn);
+            });
+         future<R> result = task->get_future();
+         submit ([task]() { (*task)(); });
+         return result;
+      }
+
+      // As above, then hands the completed future to done.
+      template <typename F, typename Done>
+      void async (F fn, Done done) {
+         using R = decltype (fn (declval<cix_connection&>()));
+         auto task = make_shared<packaged_task<R()>> (
+            [this, fn = move (fn)]() {
+               lease conn = acquire();
+               return fn (*conn);
+            });
+         submit ([task, done = move (done)]() {
+            (*task)();
+            done (task->get_future());
+         });
+      }
+
+      future<string> async_ls();
+      future<size_t> async_get (const string& filename,
+                                const string& localpath);
+      future<size_t> async_put (const string& localpath,
+                                const string& filename);
+      future<void> async_rm (const string& filename);
+      future<void> async_copy (const string& filename,
+                               const string& target);
+      future<void> async_move (const string& filename,
+                               const string& target);
+};
+
+#endif
+
@@ -0,0 +1,234 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// listing.cpp
+// listing file
+// CMPS 109
+// Assignment 4
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+using namespace std;
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "listing.h"
+
+static const string NAME_CURSOR = "name:";
+static const string INDEX_CURSOR = "index:";
+static constexpr time_t SIX_MONTHS = 15'778'476;
+
+static string option (const cix_options& options, const string& key) {
+    auto itor = options.find (key);
+    return itor == options.end() ? "" : itor->second;
+}
+
+static string mode_string (mode_t mode) {
+    string result = S_ISDIR (mode) ? "d" : S_ISLNK (mode) ? "l"
+                  : S_ISCHR (mode) ? "c" : S_ISBLK (mode) ? "b"
+                  : S_ISFIFO (mode) ? "p" : S_ISSOCK (mode) ? "s" : "-";
+    const char* rwx = "rwxrwxrwx";
+    for (int bit = 0; bit < 9; ++bit) {
+        result += mode & (0400 >> bit) ? rwx[bit] : '-';
+    }
+    if (mode & S_ISUID) result[3] = result[3] == 'x' ? 's' : 'S';
+    if (mode & S_ISGID) result[6] = result[6] == 'x' ? 's' : 'S';
+    if (mode & S_ISVTX) result[9] = result[9] == 'x' ? 't' : 'T';
+    return result;
+}
+
+// Bad options are reported by open, which is where errors go.
+directory_listing::directory_listing (const string& path_,
+                                      const cix_options& options):
+        path (path_.empty() ? "." : path_),
+        pattern (option (options, "match")),
+        reverse (option (options, "reverse") == "1") {
+    string key = option (options, "sort");
+    if (key == "none") sort = sort_key::NONE;
+    else if (key == "size") sort = sort_key::SIZE;
+    else if (key == "mtime") sort = sort_key::MTIME;
+    else if (key != "" and key != "name") done = true;
+    string count = option (options, "limit");
+    string cursor = option (options, "cursor");
+    try {
+        if (not count.empty()) limit = stoul (count);
+        if (cursor.starts_with (NAME_CURSOR)
+            and sort == sort_key::NAME) {
+            after = cursor.substr (NAME_CURSOR.size());
+        }else if (cursor.starts_with (INDEX_CURSOR)
+                  and sort != sort_key::NAME) {
+            skip = stoul (cursor.substr (INDEX_CURSOR.size()));
+        }else if (not cursor.empty()) {
+            done = true;
+        }
+    }catch (logic_error&) {
+        done = true;
+    }
+}
+
+directory_listing::~directory_listing() {
+    if (dir != nullptr) ::closedir (dir);
+}
+
+int directory_listing::open() {
+    if (done) return EINVAL;
+    dir = ::opendir (path.c_str());
+    if (dir == nullptr) return errno;
+    if (sort != sort_key::NONE) load();
+    return 0;
+}
+
+// Reads the whole directory for a sorted listing and positions
+// it just past the cursor.  With a limit only the first entries
+// in order are kept, in a heap whose top is the last of them:
+// those skipped, one page, and one more to tell if the listing
+// goes on.  Entries up to a name cursor are not kept at all.
+void directory_listing::load() {
+    auto before = [this](const entry& left, const entry& right) {
+        if (sort == sort_key::SIZE and left.size != right.size) {
+            return reverse ? left.size < right.size
+                           : left.size > right.size;
+        }
+        if (sort == sort_key::MTIME and left.mtime != right.mtime) {
+            return reverse ? left.mtime < right.mtime
+                           : left.mtime > right.mtime;
+        }
+        return reverse ? left.name > right.name
+                       : left.name < right.name;
+    };
+    size_t keep = limit > 0 ? skip + limit + 1 : 0;
+    while (dirent* ent = ::readdir (dir)) {
+        string name = ent->d_name;
+        if (name[0] == '.') continue;
+        if (not after.empty()
+            and (reverse ? name >= after : name <= after)) continue;
+        if (not pattern.empty()
+            and ::fnmatch (pattern.c_str(), name.c_str(), 0) != 0) {
+            continue;
+        }
+        struct stat stat_buf {};
+        if (sort != sort_key::NAME
+            and ::fstatat (::dirfd (dir), name.c_str(), &stat_buf,
+                           AT_SYMLINK_NOFOLLOW) != 0) continue;
+        entry item {name, stat_buf.st_size, stat_buf.st_mtime};
+        if (keep == 0) {
+            entries.push_back (move (item));
+            continue;
+        }
+        if (entries.size() == keep) {
+            if (not before (item, entries.front())) continue;
+            ::pop_heap (entries.begin(), entries.end(), before);
+            entries.back() = move (item);
+        }else {
+            entries.push_back (move (item));
+        }
+        ::push_heap (entries.begin(), entries.end(), before);
+    }
+    if (keep == 0) ::sort (entries.begin(), entries.end(), before);
+    else ::sort_heap (entries.begin(), entries.end(), before);
+    position = skip;
+}
+
+bool directory_listing::next_name (string& name) {
+    if (done) return false;
+    bool full = limit > 0 and returned >= limit;
+    if (sort != sort_key::NONE) {
+        if (position >= entries.size()) done = true;
+        if (done or full) return false;
+        name = entries[position++].name;
+    }else {
+        for (;;) {
+            dirent* ent = ::readdir (dir);
+            if (ent == nullptr) {
+                done = true;
+                return false;
+            }
+            name = ent->d_name;
+            if (name[0] == '.') continue;
+            if (not pattern.empty()
+                and ::fnmatch (pattern.c_str(), name.c_str(), 0) != 0) {
+                continue;
+            }
+            if (full) return false;
+            if (skip > 0) {
+                --skip;
+                ++position;
+                continue;
+            }
+            ++position;
+            break;
+        }
+    }
+    ++returned;
+    last = name;
+    return true;
+}
+
+string directory_listing::format (const string& name) {
+    struct stat stat_buf;
+    int dir_fd = ::dirfd (dir);
+    if (::fstatat (dir_fd, name.c_str(), &stat_buf,
+                   AT_SYMLINK_NOFOLLOW) != 0) return "";
+    auto user = users.find (stat_buf.st_uid);
+    if (user == users.end()) {
+        passwd* pw = ::getpwuid (stat_buf.st_uid);
+        user = users.emplace (stat_buf.st_uid, pw != nullptr
+                              ? pw->pw_name
+                              : to_string (stat_buf.st_uid)).first;
+    }
+    auto group = groups.find (stat_buf.st_gid);
+    if (group == groups.end()) {
+        struct group* gr = ::getgrgid (stat_buf.st_gid);
+        group = groups.emplace (stat_buf.st_gid, gr != nullptr
+                                ? gr->gr_name
+                                : to_string (stat_buf.st_gid)).first;
+    }
+    tm local;
+    ::localtime_r (&stat_buf.st_mtime, &local);
+    time_t age = ::time (nullptr) - stat_buf.st_mtime;
+    const char* date_format = age < 0 or age > SIX_MONTHS
+                            ? "%b %e  %Y" : "%b %e %H:%M";
+    char date[32];
+    ::strftime (date, sizeof date, date_format, &local);
+    ostringstream line;
+    line << mode_string (stat_buf.st_mode) << " "
+         << setw (3) << stat_buf.st_nlink << " "
+         << left << setw (8) << user->second << " "
+         << setw (8) << group->second << " "
+         << right << setw (10) << stat_buf.st_size << " "
+         << date << " " << name;
+    if (S_ISLNK (stat_buf.st_mode)) {
+        char target[4096];
+        ssize_t length = ::readlinkat (dir_fd, name.c_str(), target,
+                                       sizeof target);
+        if (length >= 0) line << " -> " << string (target, length);
+    }
+    line << "\n";
+    return line.str();
+}
+
+bool directory_listing::next (string& line) {
+    string name;
+    while (next_name (name)) {
+        line = format (name);
+        if (not line.empty()) return true;
+    }
+    return false;
+}
+
+// position counts entries consumed from the start, skipped or
+// returned.  Unsorted, a full page only knows whether more
+// entries follow once next_name has looked for one.
+string directory_listing::cursor() const {
+    if (done) return "";
+    if (sort == sort_key::NAME) return NAME_CURSOR + last;
+    return INDEX_CURSOR + to_string (position);
+}
+
@@ -0,0 +1,84 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// listing.h
+// listing file
+// CMPS 109
+// Assignment 4
+
+//
+// class directory_listing
+// one page of a directory in ls -l format, produced a line at a
+// time so cixd can stream it with bounded memory.
+//
+// Options (all optional, see cix_options):
+//    match    fnmatch glob the names must match
+//    sort     name (default), size, mtime or none
+//    reverse  1 to reverse the sort
+//    limit    entries per page, 0 for all
+//    cursor   resume after the page that returned it
+// Names starting with a dot are not listed, as with ls -l.
+//
+// Unsorted, the directory is streamed straight from readdir and
+// nothing is kept.  Sorting reads every matching entry first, by
+// size or mtime with one stat each, but holds only those up to
+// the end of the page: O(limit) entries past a name cursor, and
+// those skipped too past an index cursor.  A sorted listing with
+// no limit holds the whole directory, O(n) in its size.
+// The cursor is empty when the listing is complete; otherwise it
+// names the last entry (sorted by name, so it stays valid while
+// the directory changes) or counts the entries already returned.
+//
+
+#ifndef __LISTING_H__
+#define __LISTING_H__
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include <dirent.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+class directory_listing {
+   public:
+      enum class sort_key {NONE, NAME, SIZE, MTIME};
+   private:
+      struct entry {
+         string name;
+         off_t size;
+         time_t mtime;
+      };
+      string path;
+      string pattern;
+      sort_key sort {sort_key::NAME};
+      bool reverse {false};
+      size_t limit {0};
+      size_t skip {0};
+      string after;
+      DIR* dir {nullptr};
+      vector<entry> entries;
+      size_t position {0};
+      size_t returned {0};
+      string last;
+      bool done {false};
+      unordered_map<uid_t,string> users;
+      unordered_map<gid_t,string> groups;
+      bool next_name (string& name);
+      void load();
+      string format (const string& name);
+   public:
+      directory_listing (const string& path,
+                         const cix_options& options);
+      directory_listing (const directory_listing&) = delete;
+      directory_listing& operator= (const directory_listing&) = delete;
+      ~directory_listing();
+      int open(); // 0 or errno
+      bool next (string& line);
+      string cursor() const;
+};
+
+#endif
+
@@ -6,6 +6,7 @@
 // Assignment 4
 
 #include <cassert>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 using namespace std;
@@ -30,9 +31,73 @@ const unordered_map<cix_command,string,cix_hasher> cix_command_map {
         {cix_command::LSOUT  , "LSOUT"  },
         {cix_command::ACK    , "ACK"    },
         {cix_command::NAK    , "NAK"    },
+        {cix_command::GETFD  , "GETFD"  },
+        {cix_command::FILEFD , "FILEFD" },
+        {cix_command::COPY   , "COPY"   },
+        {cix_command::MOVE   , "MOVE"   },
+        {cix_command::SPARSEGET, "SPARSEGET"},
+        {cix_command::SPARSEOUT, "SPARSEOUT"},
+        {cix_command::SPARSEPUT, "SPARSEPUT"},
+        {cix_command::LIST     , "LIST"     },
+        {cix_command::LSEND    , "LSEND"    },
+        {cix_command::NOTMOD   , "NOTMOD"   },
+        {cix_command::FILEINFO , "FILEINFO" },
+        {cix_command::TRACE    , "TRACE"    },
+        {cix_command::WATCH    , "WATCH"    },
+        {cix_command::EVENT    , "EVENT"    },
+        {cix_command::FOLLOW   , "FOLLOW"   },
+        {cix_command::TAILOUT  , "TAILOUT"  },
+        {cix_command::TRUNC    , "TRUNC"    },
+        {cix_command::APPEND   , "APPEND"   },
+        {cix_command::PUTRANGE , "PUTRANGE" },
+        {cix_command::PUTHASH  , "PUTHASH"  },
 };
 
 
+string encode_options (const cix_options& options) {
+    string body;
+    for (const auto& [key, value]: options) {
+        body += key + "=" + value + "\n";
+    }
+    return body;
+}
+
+cix_options decode_options (const string& body) {
+    cix_options options;
+    istringstream lines (body);
+    string line;
+    while (getline (lines, line)) {
+        size_t equals = line.find ('=');
+        if (equals == string::npos) continue;
+        options[line.substr (0, equals)] = line.substr (equals + 1);
+    }
+    return options;
+}
+
+string encode_events (const vector<watch_event>& events) {
+    string body;
+    for (const watch_event& event: events) {
+        body += static_cast<char> (event.what);
+        if (event.what != watch_event::RESYNC) body += " " + event.name;
+        body += "\n";
+    }
+    return body;
+}
+
+vector<watch_event> decode_events (const string& body) {
+    vector<watch_event> events;
+    istringstream lines (body);
+    string line;
+    while (getline (lines, line)) {
+        if (line.empty()) continue;
+        auto what = static_cast<watch_event::kind> (line[0]);
+        string name = line.size() > 2 ? line.substr (2) : "";
+        events.push_back ({what, name});
+    }
+    return events;
+}
+
+
 void send_packet (base_socket& socket,
                   const void* buffer, size_t bufsize) {
     assert (sizeof (cix_header) == HEADER_SIZE);
@@ -60,11 +125,32 @@ void recv_packet (base_socket& socket, void* buffer, size_t bufsize) {
     }while (ntorecv > 0);
 }
 
+task<> send_packet (sockbuf& stream,
+                    const void* buffer, size_t bufsize) {
+    assert (sizeof (cix_header) == HEADER_SIZE);
+    co_await stream.write (buffer, bufsize);
+}
+
+task<> recv_packet (sockbuf& stream, void* buffer, size_t bufsize) {
+    assert (sizeof (cix_header) == HEADER_SIZE);
+    co_await stream.read (buffer, bufsize);
+}
+
+task<> send_fd_packet (sockbuf& stream,
+                       const void* buffer, size_t bufsize, int fd) {
+    assert (sizeof (cix_header) == HEADER_SIZE);
+    co_await stream.write_fd (buffer, bufsize, fd);
+}
+
+
+const char* command_name (cix_command command) {
+    const auto& itor = cix_command_map.find (command);
+    return itor == cix_command_map.end() ? "?" : itor->second.c_str();
+}
 
 ostream& operator<< (ostream& out, const cix_header& header) {
-    const auto& itor = cix_command_map.find (header.command);
-    string code = itor == cix_command_map.end() ? "?" : itor->second;
-    cout << "{" << header.nbytes << "," << unsigned (header.command)
+    string code = command_name (header.command);
+    out << "{" << header.nbytes << "," << unsigned (header.command)
          << "(" << code << "),\"" << header.filename << "\"}";
     return out;
 }
@@ -11,12 +11,20 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <string>
+#include <vector>
 using namespace std;
 
+#include "async.h"
+#include "sockbuf.h"
 #include "sockets.h"
 
 enum class cix_command : uint8_t {
    ERROR = 0, EXIT, GET, HELP, LS, PUT, RM, FILEOUT, LSOUT, ACK, NAK,
+   GETFD, FILEFD, COPY, MOVE, SPARSEGET, SPARSEOUT, SPARSEPUT,
+   LIST, LSEND, NOTMOD, FILEINFO, TRACE, WATCH, EVENT,
+   FOLLOW, TAILOUT, TRUNC, APPEND, PUTRANGE, PUTHASH,
 };
 constexpr size_t FILENAME_SIZE = 59;
 constexpr size_t HEADER_SIZE = 64;
@@ -26,11 +34,94 @@ struct cix_header {
    char filename[FILENAME_SIZE] {};
 };
 
+// A SPARSEGET with an options body is conditional.  The body
+// holds the validators of the client's cached copy (size, mtime
+// and sha256), or none on a cache miss.  If the server's file
+// matches them, the reply is NOTMOD; otherwise FILEINFO comes
+// first, then SPARSEOUT.  Both carry the file's current size
+// and mtime as an options body.  mtime is seconds.nanoseconds.
+//
+// Body of SPARSEOUT and SPARSEPUT: each record is followed by
+// length bytes of data at offset, and a record with length 0
+// ends the body with the file size as its offset.  Gaps are holes.
+// header.nbytes only hints at the data size, capped at 32 bits.
+struct sparse_record {
+   uint64_t offset {};
+   uint64_t length {};
+};
+static_assert (sizeof (sparse_record) == 16);
+
+// TRACE may precede any request.  Its body is the 8-byte request
+// id of the client's trace span, which the server attaches to the
+// span of the request that follows.  It has no reply.
+constexpr size_t TRACE_ID_SIZE = 8;
+
+// Options body for requests that take parameters beyond the
+// filename: one "key=value" per line.  Values cannot hold a
+// newline; unknown keys are ignored by the receiver.
+using cix_options = map<string,string>;
+constexpr size_t MAX_OPTIONS_SIZE = 0x1000;
+string encode_options (const cix_options& options);
+cix_options decode_options (const string& body);
+
+// WATCH subscribes to changes in the directory named by filename
+// (empty for the served directory).  Its options body may hold a
+// match glob.  The server replies ACK, then sends EVENT packets
+// until the client sends ACK, which the server answers with ACK
+// once no more events follow.  An EVENT body is one "kind name"
+// line per changed file, coalesced so each name appears once; an
+// idle server sends an empty EVENT now and then as a heartbeat.
+// A file replaced by rename, as PUT does, is created.  RESYNC has
+// no name: events were lost and the client should list again.
+struct watch_event {
+   enum kind: char {CREATE = 'C', MODIFY = 'M', DELETE = 'D',
+                    RESYNC = 'R'};
+   kind what;
+   string name;
+};
+constexpr size_t MAX_EVENT_SIZE = 0x10000;
+string encode_events (const vector<watch_event>& events);
+vector<watch_event> decode_events (const string& body);
+
+// FOLLOW is a GET that stays open as the file grows.  The server
+// replies ACK, then sends the file's contents and everything later
+// appended to it as TAILOUT chunks, until the client sends ACK,
+// which the server answers with ACK once no more chunks follow.
+// TRUNC, which has no body, means the file was truncated or
+// replaced by a new file of that name: the client empties its
+// copy and the chunks after it start from the beginning.  An idle
+// file gets an empty TAILOUT now and then as a heartbeat.
+
+// APPEND and PUTRANGE change a file in place, creating it if need
+// be, and are answered with ACK or NAK.  APPEND's body is the data
+// to add at the end of the file; concurrent appends never
+// interleave.  PUTRANGE's body is a sparse_record followed by its
+// length bytes of data to write at its offset.  Either body is at
+// most MAX_UPDATE_SIZE bytes of data; a larger one is NAKed EFBIG.
+constexpr size_t MAX_UPDATE_SIZE = 0x1000000;
+
+// PUTHASH is a PUT without the data, for a server that stores
+// files by content.  Its options body holds the file's size and
+// sha256.  ACK means the server had those contents and filename
+// now holds them; NAK ENOENT means it has not, and the client
+// sends a SPARSEPUT instead.  A server that does not store by
+// content NAKs EOPNOTSUPP, and need not be asked again.
+
 void send_packet (base_socket& socket,
                   const void* buffer, size_t bufsize);
 
 void recv_packet (base_socket& socket, void* buffer, size_t bufsize);
 
+task<> send_packet (sockbuf& stream,
+                    const void* buffer, size_t bufsize);
+
+task<> recv_packet (sockbuf& stream, void* buffer, size_t bufsize);
+
+task<> send_fd_packet (sockbuf& stream,
+                       const void* buffer, size_t bufsize, int fd);
+
+const char* command_name (cix_command command);
+
 ostream& operator<< (ostream& out, const cix_header& header);
 
 string get_cix_server_host (const vector<string>& args, size_t index);
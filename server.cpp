@@ -0,0 +1,1053 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// server.cpp
+// server file
+// CMPS 109
+// Assignment 4
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <climits>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fstream>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "blobstore.h"
+#include "extents.h"
+#include "iopolicy.h"
+#include "listing.h"
+#include "protocol.h"
+#include "server.h"
+#include "sha256.h"
+#include "sockbuf.h"
+#include "trace.h"
+#include "watch.h"
+
+admission* limits = nullptr;
+write_engine* writer = nullptr;
+blob_store* store = nullptr;
+constexpr size_t CHUNK_SIZE = 0x10000;
+constexpr auto WATCH_COALESCE = chrono::milliseconds (20);
+constexpr int WATCH_HEARTBEAT_MS = 5000;
+
+// The whole directory in one LSOUT, read as reply_list reads it
+// rather than by running ls -l, which would hold up the event loop
+// until the child exits.
+task<> reply_ls (sockbuf& client, cix_header& header) {
+    directory_listing listing (".", cix_options());
+    int error = listing.open();
+    if (error != 0) {
+        log << "ls: " << strerror (error) << endl;
+        header.command = cix_command::NAK;
+        header.nbytes = error;
+        co_await send_packet (client, &header, sizeof header);
+        co_return;
+    }
+    string ls_output;
+    string line;
+    while (listing.next (line)) ls_output += line;
+    header.command = cix_command::LSOUT;
+    header.nbytes = ls_output.size();
+    memset (header.filename, 0, FILENAME_SIZE);
+    log << "sending header " << header << endl;
+    co_await send_packet (client, &header, sizeof header);
+    co_await send_packet (client, ls_output.c_str(), ls_output.size());
+    log << "sent " << ls_output.size() << " bytes" << endl;
+}
+
+task<> reply_nak (sockbuf& client, cix_header& header, int error)
+{
+    header.nbytes = error;
+    header.command = cix_command::NAK;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+// Small request bodies: a destination filename or an options
+// list.  Anything longer than limit is a protocol error.
+task<string> recv_body (sockbuf& client, cix_header& header,
+                        size_t limit)
+{
+    if (header.nbytes > limit)
+    {
+        throw socket_error("request body of " + to_string(header.nbytes)
+                           + " bytes");
+    }
+    string body(header.nbytes, '\0');
+    co_await recv_packet(client, body.data(), body.size());
+    header.nbytes = 0;
+    co_return body;
+}
+
+// Streaming LS: LSOUT chunks, each flushed as soon as it is full,
+// then LSEND with the cursor for the next page as its body.
+// Chunks start small so the first entries arrive at once.
+task<> reply_list (sockbuf& client, cix_header& header)
+{
+    string body = co_await recv_body(client, header,
+                                     MAX_OPTIONS_SIZE);
+    directory_listing listing(header.filename, decode_options(body));
+    int error = listing.open();
+    if (error != 0)
+    {
+        log << "failed to list " << header.filename << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    size_t chunk_size = 0x1000;
+    size_t entries = 0;
+    string chunk;
+    string line;
+    for (;;)
+    {
+        bool more = listing.next(line);
+        if (more)
+        {
+            chunk += line;
+            ++entries;
+        }
+        if (chunk.size() >= chunk_size or (!more and !chunk.empty()))
+        {
+            header.command = cix_command::LSOUT;
+            header.nbytes = chunk.size();
+            co_await send_packet(client, &header, sizeof(cix_header));
+            co_await send_packet(client, chunk.data(), chunk.size());
+            co_await client.flush();
+            chunk.clear();
+            chunk_size = min(chunk_size * 2, CHUNK_SIZE);
+        }
+        if (!more) break;
+    }
+    string cursor = listing.cursor();
+    header.command = cix_command::LSEND;
+    header.nbytes = cursor.size();
+    co_await send_packet(client, &header, sizeof(cix_header));
+    co_await send_packet(client, cursor.data(), cursor.size());
+    log << "listed " << entries << " entries" << endl;
+}
+
+// FILEOUT and the whole of fd; once the header is sent a failure
+// ends the connection.
+task<> send_file (sockbuf& client, cix_header& header, int fd,
+                  off_t size)
+{
+    header.command = cix_command::FILEOUT;
+    header.nbytes = size;
+    co_await send_packet(client, &header, sizeof(cix_header));
+    log << "sent header" << endl;
+    int track = client.link().fd();
+    uint64_t peer = client.link().peer_key();
+    bool bulk = header.nbytes >= limits->limits().small_transfer;
+    io_stream stream(fd, io_stream::direction::READ, header.nbytes,
+                     writer->settings().io);
+    vector<char> buffer(min<size_t>(header.nbytes, CHUNK_SIZE));
+    for (size_t pos = 0; pos < header.nbytes;)
+    {
+        size_t nbytes = min(header.nbytes - pos, buffer.size());
+        {
+            trace_span reading("read", track);
+            if (pread(fd, buffer.data(), nbytes, pos)
+                != static_cast<ssize_t>(nbytes))
+            {
+                throw socket_error(string(header.filename)
+                                   + ": short read");
+            }
+            stream.advance(pos, nbytes);
+        }
+        {
+            trace_span waiting("throttle", track);
+            co_await limits->throttle(peer, nbytes, bulk);
+        }
+        trace_span sending("send", track);
+        co_await send_packet(client, buffer.data(), nbytes);
+        pos += nbytes;
+    }
+    stream.finish();
+}
+
+task<> reply_get (sockbuf& client, cix_header& header)
+{
+    int track = client.link().fd();
+    optional<trace_span> opening(in_place, "open", track);
+    int fd = open(header.filename, O_RDONLY | O_CLOEXEC);
+    struct stat california;
+    if (fd < 0 or fstat(fd, &california) != 0)
+    {
+        log << "failed to open file" << endl;
+        int error = errno;
+        if (fd >= 0) close(fd);
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    opening.reset();
+    auto slot = co_await limits->wait_transfer(california.st_size);
+    if (!slot)
+    {
+        log << "too many transfers" << endl;
+        close(fd);
+        co_await reply_nak(client, header, EAGAIN);
+        co_return;
+    }
+    try
+    {
+        co_await send_file(client, header, fd, california.st_size);
+    }
+    catch (socket_error&)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    log << "sent " << header.nbytes << " bytes" << endl;
+}
+
+// Sends the data extents of fd as a sparse body; holes cost one
+// record between extents and nothing else.  Throttling and the
+// page cache policy go by data_bytes, the bytes actually sent.
+task<> send_extents (sockbuf& client, int fd, off_t size,
+                     off_t data_bytes)
+{
+    uint64_t peer = client.link().peer_key();
+    int track = client.link().fd();
+    bool bulk = data_bytes
+              >= static_cast<off_t>(limits->limits().small_transfer);
+    io_stream stream(fd, io_stream::direction::READ, data_bytes,
+                     writer->settings().io);
+    vector<char> buffer(CHUNK_SIZE);
+    off_t offset = 0;
+    while (auto data = next_extent(fd, offset, size))
+    {
+        sparse_record record;
+        record.offset = data->offset;
+        record.length = data->length;
+        co_await send_packet(client, &record, sizeof(sparse_record));
+        for (off_t pos = data->offset; pos < data->end();)
+        {
+            size_t nbytes = min<off_t>(data->end() - pos, CHUNK_SIZE);
+            {
+                trace_span reading("read", track);
+                if (pread(fd, buffer.data(), nbytes, pos)
+                    != static_cast<ssize_t>(nbytes))
+                {
+                    throw socket_error("sparse read: short read");
+                }
+                stream.advance(pos, nbytes);
+            }
+            {
+                trace_span waiting("throttle", track);
+                co_await limits->throttle(peer, nbytes, bulk);
+            }
+            trace_span sending("send", track);
+            co_await send_packet(client, buffer.data(), nbytes);
+            pos += nbytes;
+        }
+        offset = data->end();
+    }
+    sparse_record last;
+    last.offset = size;
+    co_await send_packet(client, &last, sizeof(sparse_record));
+    stream.finish();
+}
+
+// Validators of the server's copy.  The SHA-256 is only computed
+// when size matches and mtime does not, and is kept in an xattr
+// keyed by mtime so it is computed once per version of the file.
+string mtime_string (const struct stat& california)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof buffer, "%lld.%09ld",
+             static_cast<long long>(california.st_mtim.tv_sec),
+             california.st_mtim.tv_nsec);
+    return buffer;
+}
+
+constexpr const char* HASH_XATTR = "user.cix.sha256";
+
+string content_hash (int fd, const string& mtime)
+{
+    char value[128];
+    ssize_t length = fgetxattr(fd, HASH_XATTR, value, sizeof value);
+    string cached = length > 0 ? string(value, length) : "";
+    if (cached.starts_with(mtime + " "))
+    {
+        return cached.substr(mtime.size() + 1);
+    }
+    string hash = sha256_file(fd);
+    cached = mtime + " " + hash;
+    if (!hash.empty())
+    {
+        fsetxattr(fd, HASH_XATTR, cached.data(), cached.size(), 0);
+    }
+    return hash;
+}
+
+// A file put through the store has its hash from the upload, so
+// it is kept the same way and never computed again.
+void remember_hash (const string& path, const string& hash)
+{
+    struct stat california;
+    if (hash.empty() or stat(path.c_str(), &california) != 0) return;
+    string cached = mtime_string(california) + " " + hash;
+    setxattr(path.c_str(), HASH_XATTR, cached.data(), cached.size(), 0);
+}
+
+// Commits file through the store, if there is one, by the digest
+// of what was written.
+task<int> commit_upload (write_engine::upload& file,
+                         blob_digest& digest, uint64_t size,
+                         const string& path)
+{
+    if (store == nullptr) co_return co_await file.commit();
+    string hash = digest.hex(size);
+    int error = co_await store->commit(file, hash);
+    if (error == 0) remember_hash(path, hash);
+    co_return error;
+}
+
+// Sparse GET: the file size is unlimited and only data extents
+// are read and sent.  With validators it is a conditional GET.
+task<> reply_sparse_get (sockbuf& client, cix_header& header)
+{
+    string body = co_await recv_body(client, header,
+                                     MAX_OPTIONS_SIZE);
+    int track = client.link().fd();
+    optional<trace_span> opening(in_place, "open", track);
+    int fd = open(header.filename, O_RDONLY | O_CLOEXEC);
+    struct stat california;
+    int error = 0;
+    if (fd < 0 or fstat(fd, &california) != 0) error = errno;
+    else if (S_ISDIR(california.st_mode)) error = EISDIR;
+    else if (!S_ISREG(california.st_mode)) error = EINVAL;
+    opening.reset();
+    if (error != 0)
+    {
+        log << "failed to open file" << endl;
+        if (fd >= 0) close(fd);
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    string info;
+    if (!body.empty())
+    {
+        cix_options validators = decode_options(body);
+        trace_span validating("validate", track);
+        cix_options current;
+        current["size"] = to_string(california.st_size);
+        current["mtime"] = mtime_string(california);
+        info = encode_options(current);
+        bool same = validators["size"] == current["size"]
+                and (validators["mtime"] == current["mtime"]
+                     or (!validators["sha256"].empty()
+                         and validators["sha256"]
+                             == content_hash(fd, current["mtime"])));
+        if (same)
+        {
+            close(fd);
+            header.command = cix_command::NOTMOD;
+            header.nbytes = info.size();
+            co_await send_packet(client, &header, sizeof(cix_header));
+            co_await send_packet(client, info.data(), info.size());
+            log << "not modified" << endl;
+            co_return;
+        }
+    }
+    off_t data_bytes = allocated_bytes(california);
+    auto slot = co_await limits->wait_transfer(data_bytes);
+    if (!slot)
+    {
+        log << "too many transfers" << endl;
+        close(fd);
+        co_await reply_nak(client, header, EAGAIN);
+        co_return;
+    }
+    try
+    {
+        if (!info.empty())
+        {
+            header.command = cix_command::FILEINFO;
+            header.nbytes = info.size();
+            co_await send_packet(client, &header, sizeof(cix_header));
+            co_await send_packet(client, info.data(), info.size());
+        }
+        header.command = cix_command::SPARSEOUT;
+        header.nbytes = min<off_t>(data_bytes, UINT32_MAX);
+        co_await send_packet(client, &header, sizeof(cix_header));
+        co_await send_extents(client, fd, california.st_size,
+                              data_bytes);
+    }
+    catch (socket_error&)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    log << "sent " << california.st_size << " bytes, "
+        << data_bytes << " allocated" << endl;
+}
+
+// Local fast path: a Unix socket client is handed a read-only
+// descriptor instead of the bytes, so the server's cost does not
+// depend on the file size.
+task<> reply_getfd (sockbuf& client, cix_header& header)
+{
+    if (client.link().family() != AF_UNIX)
+    {
+        co_await reply_nak(client, header, EOPNOTSUPP);
+        co_return;
+    }
+    int fd = open(header.filename, O_RDONLY | O_CLOEXEC);
+    struct stat california;
+    int error = 0;
+    if (fd < 0 or fstat(fd, &california) != 0) error = errno;
+    else if (S_ISDIR(california.st_mode)) error = EISDIR;
+    else if (!S_ISREG(california.st_mode)) error = EINVAL;
+    if (error != 0)
+    {
+        log << "failed to open file" << endl;
+        if (fd >= 0) close(fd);
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    header.command = cix_command::FILEFD;
+    header.nbytes = min<off_t>(california.st_size, UINT32_MAX);
+    try
+    {
+        co_await send_fd_packet(client, &header, sizeof(cix_header),
+                                fd);
+    }
+    catch (socket_error&)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    log << "passed descriptor for " << california.st_size
+        << " bytes" << endl;
+}
+
+task<> reply_put (sockbuf& client, cix_header& header)
+{
+    // The body follows the header regardless, so every failure
+    // still drains it before the NAK.
+    int error = 0;
+    auto slot = co_await limits->wait_transfer(header.nbytes);
+    write_engine::upload file(*writer);
+    if (!slot)
+    {
+        log << "too many transfers" << endl;
+        error = EAGAIN;
+    }
+    else
+    {
+        error = file.open(header.filename, header.nbytes);
+        if (error != 0)
+        {
+            log << "failed to open file" << endl;
+        }
+    }
+    uint64_t peer = client.link().peer_key();
+    bool bulk = header.nbytes >= limits->limits().small_transfer;
+    vector<char> buffer(min<size_t>(header.nbytes, CHUNK_SIZE));
+    blob_digest digest;
+    for (size_t remain = header.nbytes; remain > 0;)
+    {
+        size_t nbytes = min(remain, buffer.size());
+        co_await recv_packet(client, buffer.data(), nbytes);
+        co_await limits->throttle(peer, nbytes, bulk);
+        if (error == 0)
+        {
+            error = file.write(buffer.data(), nbytes);
+            if (error != 0) log << "failed to write file" << endl;
+        }
+        if (store != nullptr)
+        {
+            digest.add(header.nbytes - remain, buffer.data(), nbytes);
+        }
+        remain -= nbytes;
+    }
+    if (error == 0)
+    {
+        error = co_await commit_upload(file, digest, header.nbytes,
+                                       header.filename);
+        if (error != 0) log << "failed to commit file" << endl;
+    }
+    if (error != 0)
+    {
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    log << "wrote file" << endl;
+    header.command = cix_command::ACK;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+// Sparse PUT: extents are written where they belong and the
+// final truncate leaves the gaps as holes.  As with PUT, the body
+// is drained whatever goes wrong.
+task<> reply_sparse_put (sockbuf& client, cix_header& header)
+{
+    int error = 0;
+    auto slot = co_await limits->wait_transfer(header.nbytes);
+    write_engine::upload file(*writer);
+    if (!slot)
+    {
+        log << "too many transfers" << endl;
+        error = EAGAIN;
+    }
+    else
+    {
+        error = file.open(header.filename, 0);
+        if (error != 0) log << "failed to open file" << endl;
+        else file.expect(header.nbytes);
+    }
+    uint64_t peer = client.link().peer_key();
+    bool bulk = header.nbytes >= limits->limits().small_transfer;
+    vector<char> buffer(CHUNK_SIZE);
+    blob_digest digest;
+    sparse_record record;
+    for (;;)
+    {
+        co_await recv_packet(client, &record, sizeof(sparse_record));
+        if (record.length == 0) break;
+        if (error == 0) error = file.allocate(record.offset,
+                                              record.length);
+        for (uint64_t pos = record.offset, end = pos + record.length;
+             pos < end;)
+        {
+            size_t nbytes = min<uint64_t>(end - pos, buffer.size());
+            co_await recv_packet(client, buffer.data(), nbytes);
+            co_await limits->throttle(peer, nbytes, bulk);
+            if (error == 0) error = file.write_at(buffer.data(),
+                                                  nbytes, pos);
+            if (store != nullptr)
+            {
+                digest.add(pos, buffer.data(), nbytes);
+            }
+            pos += nbytes;
+        }
+    }
+    if (error == 0) error = file.truncate(record.offset);
+    if (error == 0)
+    {
+        error = co_await commit_upload(file, digest, record.offset,
+                                       header.filename);
+    }
+    if (error != 0)
+    {
+        log << "failed to write file" << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    log << "wrote sparse file of " << record.offset << " bytes" << endl;
+    header.command = cix_command::ACK;
+    header.nbytes = 0;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+// Hash-first PUT: the client sends the size and sha256 of its
+// file, and the file is made from the store's copy if there is
+// one, so identical contents cross the network once.
+task<> reply_put_hash (sockbuf& client, cix_header& header)
+{
+    cix_options fields = decode_options(
+        co_await recv_body(client, header, MAX_OPTIONS_SIZE));
+    int error = EOPNOTSUPP;
+    off_t size = 0;
+    if (store != nullptr)
+    {
+        try
+        {
+            size = stoll(fields["size"]);
+            error = 0;
+        }
+        catch (logic_error&)
+        {
+            error = EINVAL;
+        }
+    }
+    if (error == 0)
+    {
+        error = co_await store->link(fields["sha256"], size,
+                                     header.filename);
+    }
+    if (error != 0)
+    {
+        log << (error == EOPNOTSUPP ? "not storing by content"
+                : error == ENOENT ? "contents not stored"
+                : "failed to link stored copy") << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    log << "linked stored copy of " << size << " bytes" << endl;
+    header.command = cix_command::ACK;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+// APPEND and PUTRANGE.  The whole body is received before the
+// file is even opened, so a client that stalls or drops part way
+// holds no lock and leaves no partial record behind.  As with PUT
+// the body is drained whatever goes wrong.
+task<> reply_update (sockbuf& client, cix_header& header)
+{
+    bool append = header.command == cix_command::APPEND;
+    sparse_record range;
+    if (!append)
+    {
+        if (header.nbytes < sizeof(sparse_record))
+        {
+            throw socket_error("PUTRANGE body of "
+                               + to_string(header.nbytes) + " bytes");
+        }
+        co_await recv_packet(client, &range, sizeof(sparse_record));
+        header.nbytes -= sizeof(sparse_record);
+        if (range.length != header.nbytes)
+        {
+            throw socket_error("PUTRANGE length mismatch");
+        }
+    }
+    int error = header.nbytes > MAX_UPDATE_SIZE ? EFBIG : 0;
+    auto slot = co_await limits->wait_transfer(header.nbytes);
+    if (error == 0 and !slot)
+    {
+        log << "too many transfers" << endl;
+        error = EAGAIN;
+    }
+    uint64_t peer = client.link().peer_key();
+    bool bulk = header.nbytes >= limits->limits().small_transfer;
+    vector<char> data(min<size_t>(header.nbytes, error == 0
+                                  ? MAX_UPDATE_SIZE : CHUNK_SIZE));
+    for (size_t pos = 0; pos < header.nbytes;)
+    {
+        size_t nbytes = min(header.nbytes - pos, CHUNK_SIZE);
+        char* into = data.data() + (error == 0 ? pos : 0);
+        co_await recv_packet(client, into, nbytes);
+        co_await limits->throttle(peer, nbytes, bulk);
+        pos += nbytes;
+    }
+    write_engine::update file(*writer);
+    if (error == 0) error = file.open(header.filename, append);
+    if (error == 0) error = co_await file.lock();
+    if (error == 0 and store != nullptr)
+    {
+        error = co_await file.unshare();
+    }
+    if (error == 0 and append)
+    {
+        error = file.append(data.data(), header.nbytes);
+    }
+    else if (error == 0)
+    {
+        off_t offset = static_cast<off_t>(range.offset);
+        error = file.write_at(data.data(), header.nbytes, offset);
+    }
+    if (error == 0) error = co_await file.commit();
+    if (error != 0)
+    {
+        log << "failed to update file" << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    log << (append ? "appended " : "wrote ") << header.nbytes
+        << " bytes" << endl;
+    header.command = cix_command::ACK;
+    header.nbytes = 0;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+task<> reply_rm (sockbuf& client, cix_header& header)
+{
+
+    if(unlink(header.filename))
+    {
+        log << "failed to remove" << endl;
+        header.nbytes = errno;
+        header.command = cix_command::NAK;
+        co_await send_packet(client, &header, sizeof(cix_header));
+    }
+    else
+    {
+        log << "removed file" << endl;
+        header.command = cix_command::ACK;
+        co_await send_packet(client, &header, sizeof(cix_header));
+    }
+    log << "some form of acknowledgement" << endl;
+}
+
+// COPY and MOVE carry the destination filename as their body.
+task<string> recv_target (sockbuf& client, cix_header& header)
+{
+    string target = co_await recv_body(client, header,
+                                       FILENAME_SIZE - 1);
+    if (target.empty()) throw socket_error("missing destination");
+    co_return target;
+}
+
+// Server side copy: the data never crosses the network and, on a
+// filesystem with reflinks, is not copied at all.  Neither is a
+// file in the store, which is linked to its blob; if that fails
+// for any reason it is copied as usual.
+task<> reply_copy (sockbuf& client, cix_header& header)
+{
+    string target = co_await recv_target(client, header);
+    int source = open(header.filename, O_RDONLY | O_CLOEXEC);
+    struct stat california;
+    int error = 0;
+    if (source < 0 or fstat(source, &california) != 0) error = errno;
+    else if (S_ISDIR(california.st_mode)) error = EISDIR;
+    else if (!S_ISREG(california.st_mode)) error = EINVAL;
+    bool linked = false;
+    if (error == 0 and store != nullptr and california.st_nlink > 1)
+    {
+        string hash = content_hash(source, mtime_string(california));
+        linked = co_await store->link(hash, california.st_size,
+                                      target) == 0;
+    }
+    if (error == 0 and !linked)
+    {
+        write_engine::upload file(*writer);
+        error = file.open(target, 0);
+        if (error == 0) error = co_await file.copy_from(source);
+        if (error == 0) error = co_await file.commit();
+    }
+    if (source >= 0) close(source);
+    if (error != 0)
+    {
+        log << "failed to copy to " << target << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    log << "copied file to " << target << endl;
+    header.command = cix_command::ACK;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+task<> reply_move (sockbuf& client, cix_header& header)
+{
+    string target = co_await recv_target(client, header);
+    int error = 0;
+    if (rename(header.filename, target.c_str()) != 0) error = errno;
+    if (error == 0) error = co_await writer->sync_directory(target);
+    if (error != 0)
+    {
+        log << "failed to move to " << target << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    log << "moved file to " << target << endl;
+    header.command = cix_command::ACK;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+
+// Sends the pending events of watch as EVENT packets, or one empty
+// EVENT as a heartbeat.
+task<> send_events (sockbuf& client, cix_header& header,
+                    directory_watch& watch, bool heartbeat)
+{
+    while (heartbeat or !watch.empty())
+    {
+        string body = watch.take(MAX_EVENT_SIZE);
+        header.command = cix_command::EVENT;
+        header.nbytes = body.size();
+        co_await send_packet(client, &header, sizeof(cix_header));
+        co_await send_packet(client, body.data(), body.size());
+        heartbeat = false;
+    }
+    co_await client.flush();
+}
+
+// An epoll set holding an inotify descriptor and the client's
+// socket, so a single wait covers new changes, the client's ACK
+// and the heartbeat timeout.  Returns -1 with errno set on failure.
+int push_waiter (sockbuf& client, int notify)
+{
+    int waiter = epoll_create1(EPOLL_CLOEXEC);
+    if (waiter < 0) return -1;
+    for (int fd: {notify, client.link().fd()})
+    {
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(waiter, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            int error = errno;
+            close(waiter);
+            errno = error;
+            return -1;
+        }
+    }
+    return waiter;
+}
+
+// Waits up to timeout_ms for a change, then a moment longer so a
+// burst of changes is read at once.  Returns false on timeout.
+// Anything from the client can only be the ACK that ends the
+// request, so it sets stopping.
+task<bool> wait_change (sockbuf& client, int waiter, int timeout_ms,
+                        bool& stopping)
+{
+    bool ready = client.available() > 0
+              or co_await wait_readable(waiter, timeout_ms);
+    epoll_event events[2];
+    int count = epoll_wait(waiter, events, 2, 0);
+    for (int index = 0; index < count; ++index)
+    {
+        if (events[index].data.fd == client.link().fd())
+        {
+            stopping = true;
+        }
+    }
+    if (client.available() > 0) stopping = true;
+    if (ready and !stopping and timeout_ms != 0)
+    {
+        co_await sleep_for(WATCH_COALESCE);
+    }
+    co_return ready;
+}
+
+// Ends WATCH or FOLLOW: the client's ACK, answered with ACK.
+task<> finish_push (sockbuf& client, cix_header& header)
+{
+    cix_header stop;
+    co_await recv_packet(client, &stop, sizeof(cix_header));
+    if (stop.command != cix_command::ACK)
+    {
+        throw socket_error(string(command_name(header.command))
+                           + " ended by "
+                           + command_name(stop.command));
+    }
+    header.command = cix_command::ACK;
+    header.nbytes = 0;
+    co_await send_packet(client, &header, sizeof(cix_header));
+}
+
+// Pushes changes until the client sends ACK.
+task<> reply_watch (sockbuf& client, cix_header& header)
+{
+    string body = co_await recv_body(client, header,
+                                     MAX_OPTIONS_SIZE);
+    directory_watch watch(decode_options(body));
+    string path = header.filename[0] == '\0' ? "." : header.filename;
+    int error = watch.open(path);
+    int waiter = error == 0 ? push_waiter(client, watch.descriptor())
+                            : -1;
+    if (error == 0 and waiter < 0) error = errno;
+    if (error != 0)
+    {
+        log << "watch " << path << ": " << strerror(error) << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    header.command = cix_command::ACK;
+    co_await send_packet(client, &header, sizeof(cix_header));
+    co_await client.flush();
+    log << "watching " << path << endl;
+    try
+    {
+        bool stopping = false;
+        while (!stopping)
+        {
+            bool ready = co_await wait_change(client, waiter,
+                                              WATCH_HEARTBEAT_MS,
+                                              stopping);
+            watch.drain();
+            co_await send_events(client, header, watch, !ready);
+        }
+    }
+    catch (socket_error&)
+    {
+        close(waiter);
+        throw;
+    }
+    close(waiter);
+    header.command = cix_command::WATCH;
+    co_await finish_push(client, header);
+    log << "stopped watching " << path << endl;
+}
+
+// Sends what the file gained since the last call, at most limit
+// bytes of it, with TRUNC wherever it started over, or one empty
+// TAILOUT as a heartbeat.  Returns true once caught up.
+task<bool> send_tail (sockbuf& client, cix_header& header,
+                      file_tail& tail, bool heartbeat, size_t limit)
+{
+    uint64_t peer = client.link().peer_key();
+    string chunk;
+    size_t sent = 0;
+    bool caught_up = false;
+    while (sent < limit)
+    {
+        auto progress = tail.next(chunk, CHUNK_SIZE);
+        if (progress == file_tail::progress::FAILED)
+        {
+            throw socket_error(string(header.filename) + ": "
+                               + strerror(errno));
+        }
+        caught_up = progress == file_tail::progress::IDLE;
+        if (caught_up and !heartbeat) break;
+        header.command = progress == file_tail::progress::RESTART
+                       ? cix_command::TRUNC : cix_command::TAILOUT;
+        header.nbytes = chunk.size();
+        co_await send_packet(client, &header, sizeof(cix_header));
+        co_await send_packet(client, chunk.data(), chunk.size());
+        co_await limits->throttle(peer, chunk.size(), false);
+        sent += chunk.size();
+        heartbeat = false;
+        if (caught_up) break;
+    }
+    co_await client.flush();
+    co_return caught_up;
+}
+
+// Follow mode GET.  Each wake reads the file up to its end, a few
+// chunks at a time so the client's ACK is still noticed while a
+// fast writer keeps the file ahead of the socket.  No transfer
+// slot is held, since the request may last for days.
+task<> reply_follow (sockbuf& client, cix_header& header)
+{
+    file_tail tail(header.filename);
+    int error = tail.open();
+    int waiter = error == 0 ? push_waiter(client, tail.descriptor())
+                            : -1;
+    if (error == 0 and waiter < 0) error = errno;
+    if (error != 0)
+    {
+        log << "follow " << header.filename << ": "
+            << strerror(error) << endl;
+        co_await reply_nak(client, header, error);
+        co_return;
+    }
+    header.command = cix_command::ACK;
+    co_await send_packet(client, &header, sizeof(cix_header));
+    log << "following " << header.filename << endl;
+    try
+    {
+        bool stopping = false;
+        bool heartbeat = false;
+        while (!stopping)
+        {
+            tail.drain();
+            bool caught_up = co_await send_tail(client, header, tail,
+                                                heartbeat,
+                                                16 * CHUNK_SIZE);
+            int timeout_ms = caught_up ? WATCH_HEARTBEAT_MS : 0;
+            heartbeat = !co_await wait_change(client, waiter,
+                                              timeout_ms, stopping)
+                      and caught_up;
+        }
+    }
+    catch (socket_error&)
+    {
+        close(waiter);
+        throw;
+    }
+    close(waiter);
+    header.command = cix_command::FOLLOW;
+    co_await finish_push(client, header);
+    log << "stopped following " << header.filename << endl;
+}
+
+// The request id a client sent with TRACE, for its next request.
+task<uint64_t> recv_trace_id (sockbuf& client, cix_header& header)
+{
+    string body = co_await recv_body(client, header, TRACE_ID_SIZE);
+    if (body.size() != TRACE_ID_SIZE)
+    {
+        throw socket_error("trace id of " + to_string(body.size())
+                           + " bytes");
+    }
+    uint64_t request;
+    memcpy(&request, body.data(), sizeof request);
+    co_return request;
+}
+
+// Request loop for one connection, shared by the forked server
+// (run to completion by sync_wait), and the event driven server
+// and cixbench (spawned on a scheduler).  Each connection is its
+// own track in the trace, since coroutines interleave on one
+// thread.
+task<> serve (transport& link) {
+    log << "connected to " << link.name() << endl;
+    sockbuf client (link);
+    int track = link.fd();
+    uint64_t request = 0;
+    try {
+        for (;;) {
+            cix_header header;
+            {
+                trace_span waiting ("wait request", track);
+                co_await recv_packet (client, &header, sizeof header);
+            }
+            log << "received header " << header << endl;
+            if (header.command == cix_command::TRACE) {
+                request = co_await recv_trace_id (client, header);
+                continue;
+            }
+            trace_span handling (command_name (header.command), track,
+                                 exchange (request, 0),
+                                 trace_flow::IN);
+            switch (header.command) {
+                case cix_command::LS:
+                    co_await reply_ls (client, header);
+                    break;
+                case cix_command::GET:
+                    co_await reply_get(client, header);
+                    break;
+                case cix_command::GETFD:
+                    co_await reply_getfd(client, header);
+                    break;
+                case cix_command::PUT:
+                    co_await reply_put(client, header);
+                    break;
+                case cix_command::RM:
+                    co_await reply_rm(client, header);
+                    break;
+                case cix_command::SPARSEGET:
+                    co_await reply_sparse_get(client, header);
+                    break;
+                case cix_command::SPARSEPUT:
+                    co_await reply_sparse_put(client, header);
+                    break;
+                case cix_command::LIST:
+                    co_await reply_list(client, header);
+                    break;
+                case cix_command::COPY:
+                    co_await reply_copy(client, header);
+                    break;
+                case cix_command::MOVE:
+                    co_await reply_move(client, header);
+                    break;
+                case cix_command::WATCH:
+                    co_await reply_watch(client, header);
+                    break;
+                case cix_command::FOLLOW:
+                    co_await reply_follow(client, header);
+                    break;
+                case cix_command::APPEND:
+                case cix_command::PUTRANGE:
+                    co_await reply_update(client, header);
+                    break;
+                case cix_command::PUTHASH:
+                    co_await reply_put_hash(client, header);
+                    break;
+                default:
+                    log << "invalid header from client:"
+                        << header << endl;
+                    break;
+            }
+        }
+    }catch (socket_error& error) {
+        log << error.what() << endl;
+    }
+    log << "finishing " << link.name() << endl;
+}
+
@@ -0,0 +1,37 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// server.h
+// server file
+// CMPS 109
+// Assignment 4
+
+//
+// serve
+// the cixd request loop for one client over any transport, run by
+// the forked server, the event driven server and cixbench alike.
+// Requests go through limits and files are written by writer, so
+// both must be set before the first client is served.  With store
+// set, files are kept by content in it and PUTHASH is answered;
+// without, every file is its own copy.  Progress is logged to log,
+// which each program defines for itself.
+//
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "admission.h"
+#include "async.h"
+#include "blobstore.h"
+#include "logstream.h"
+#include "transport.h"
+#include "writer.h"
+
+extern logstream log;
+extern admission* limits;
+extern write_engine* writer;
+extern blob_store* store;
+
+task<> serve (transport& link);
+
+#endif
+
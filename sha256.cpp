@@ -0,0 +1,140 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// sha256.cpp
+// sha256 file
+// CMPS 109
+// Assignment 4
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+#include <unistd.h>
+
+#include "sha256.h"
+
+static constexpr uint32_t ROUND_CONSTANTS[64] {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+   0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+   0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+   0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+   0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+   0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+   0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+   0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotate (uint32_t word, int count) {
+    return word >> count | word << (32 - count);
+}
+
+sha256::sha256():
+        state {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+               0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {
+}
+
+void sha256::compress (const uint8_t* data) {
+    uint32_t words[64];
+    for (int index = 0; index < 16; ++index) {
+        words[index] = uint32_t (data[4 * index]) << 24
+                     | uint32_t (data[4 * index + 1]) << 16
+                     | uint32_t (data[4 * index + 2]) << 8
+                     | uint32_t (data[4 * index + 3]);
+    }
+    for (int index = 16; index < 64; ++index) {
+        uint32_t low = words[index - 15];
+        uint32_t high = words[index - 2];
+        uint32_t sigma0 = rotate (low, 7) ^ rotate (low, 18) ^ low >> 3;
+        uint32_t sigma1 = rotate (high, 17) ^ rotate (high, 19)
+                        ^ high >> 10;
+        words[index] = words[index - 16] + sigma0
+                     + words[index - 7] + sigma1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int index = 0; index < 64; ++index) {
+        uint32_t sum1 = rotate (e, 6) ^ rotate (e, 11) ^ rotate (e, 25);
+        uint32_t choose = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + sum1 + choose + ROUND_CONSTANTS[index]
+                       + words[index];
+        uint32_t sum0 = rotate (a, 2) ^ rotate (a, 13) ^ rotate (a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = sum0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256::update (const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*> (data);
+    length += size;
+    if (used > 0) {
+        size_t ncopy = min (size, sizeof block - used);
+        memcpy (block + used, bytes, ncopy);
+        used += ncopy;
+        bytes += ncopy;
+        size -= ncopy;
+        if (used < sizeof block) return;
+        compress (block);
+        used = 0;
+    }
+    for (; size >= sizeof block; bytes += sizeof block,
+                                 size -= sizeof block) {
+        compress (bytes);
+    }
+    memcpy (block, bytes, size);
+    used = size;
+}
+
+string sha256::hex() {
+    uint64_t bits = length * 8;
+    uint8_t padding[72] {0x80};
+    size_t npad = (used < 56 ? 56 : 120) - used;
+    for (int index = 0; index < 8; ++index) {
+        padding[npad + index] = bits >> (56 - 8 * index);
+    }
+    update (padding, npad + 8);
+    static const char digits[] = "0123456789abcdef";
+    string result;
+    for (uint32_t word: state) {
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            result += digits[word >> shift & 0xF];
+        }
+    }
+    return result;
+}
+
+string sha256_file (int fd) {
+    sha256 digest;
+    vector<char> buffer (0x40000);
+    for (off_t offset = 0;;) {
+        ssize_t nbytes = ::pread (fd, buffer.data(), buffer.size(),
+                                  offset);
+        if (nbytes == 0) break;
+        if (nbytes < 0) {
+            if (errno == EINTR) continue;
+            return "";
+        }
+        digest.update (buffer.data(), nbytes);
+        offset += nbytes;
+    }
+    return digest.hex();
+}
+
@@ -0,0 +1,41 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// sha256.h
+// sha256 file
+// CMPS 109
+// Assignment 4
+
+//
+// class sha256
+// FIPS 180-4 SHA-256, used to validate cached files.  update may
+// be called any number of times before hex, which finishes the
+// digest and returns it as 64 lowercase hex digits.
+//
+// sha256_file hashes a whole file from offset 0 without moving
+// its file offset; it returns an empty string on a read error.
+//
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <cstdint>
+#include <string>
+using namespace std;
+
+class sha256 {
+   private:
+      uint32_t state[8];
+      uint8_t block[64];
+      size_t used {0};
+      uint64_t length {0};
+      void compress (const uint8_t* data);
+   public:
+      sha256();
+      void update (const void* data, size_t size);
+      string hex();
+};
+
+string sha256_file (int fd);
+
+#endif
+
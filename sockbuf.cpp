@@ -0,0 +1,122 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// sockbuf.cpp
+// sockbuf file
+// CMPS 109
+// Assignment 4
+
+#include <cstring>
+#include <new>
+using namespace std;
+
+#include <sys/uio.h>
+
+#include "sockbuf.h"
+
+static char* aligned_buffer() {
+    void* buffer = aligned_alloc (sockbuf::ALIGNMENT, sockbuf::BUFSIZE);
+    if (buffer == nullptr) throw bad_alloc();
+    return static_cast<char*> (buffer);
+}
+
+sockbuf::sockbuf (base_socket& socket):
+        own_link (make_unique<socket_transport> (socket)),
+        link_ (*own_link),
+        rbuf (aligned_buffer(), free),
+        wbuf (aligned_buffer(), free) {
+}
+
+sockbuf::sockbuf (transport& link):
+        link_ (link),
+        rbuf (aligned_buffer(), free),
+        wbuf (aligned_buffer(), free) {
+}
+
+// One recv of whatever the kernel has, up to a full buffer.
+task<size_t> sockbuf::fill() {
+    if (wend > 0) co_await flush();
+    rpos = rend = 0;
+    size_t nbytes = co_await link_.recv (rbuf.get(), BUFSIZE);
+    if (nbytes == 0) throw socket_error (link_.name() + " is closed");
+    rend = nbytes;
+    co_return rend;
+}
+
+task<> sockbuf::read (void* buffer, size_t bufsize) {
+    char* bufptr = static_cast<char*> (buffer);
+    size_t ncopy = min (bufsize, available());
+    memcpy (bufptr, rbuf.get() + rpos, ncopy);
+    rpos += ncopy;
+    bufptr += ncopy;
+    bufsize -= ncopy;
+    // Large remainders go straight to the caller's memory.
+    while (bufsize >= BUFSIZE) {
+        if (wend > 0) co_await flush();
+        size_t nbytes = co_await link_.recv (bufptr, bufsize);
+        if (nbytes == 0) throw socket_error (link_.name()
+                                             + " is closed");
+        bufptr += nbytes;
+        bufsize -= nbytes;
+    }
+    while (bufsize > 0) {
+        ncopy = min (bufsize, co_await fill());
+        memcpy (bufptr, rbuf.get(), ncopy);
+        rpos = ncopy;
+        bufptr += ncopy;
+        bufsize -= ncopy;
+    }
+}
+
+task<> sockbuf::write (const void* buffer, size_t bufsize) {
+    const char* bufptr = static_cast<const char*> (buffer);
+    if (wend + bufsize <= BUFSIZE) {
+        memcpy (wbuf.get() + wend, bufptr, bufsize);
+        wend += bufsize;
+        co_return;
+    }
+    if (bufsize < BUFSIZE) {
+        co_await flush();
+        memcpy (wbuf.get(), bufptr, bufsize);
+        wend = bufsize;
+        co_return;
+    }
+    // Send pending output and the large buffer in one gather write.
+    iovec iov[2] {{wbuf.get(), wend},
+                  {const_cast<char*> (bufptr), bufsize}};
+    size_t total = wend + bufsize;
+    while (total > 0) {
+        size_t nbytes = co_await link_.send (iov, 2);
+        total -= nbytes;
+        for (iovec& vec: iov) {
+            size_t nskip = min (nbytes, vec.iov_len);
+            vec.iov_base = static_cast<char*> (vec.iov_base) + nskip;
+            vec.iov_len -= nskip;
+            nbytes -= nskip;
+        }
+    }
+    wend = 0;
+}
+
+task<> sockbuf::flush() {
+    iovec iov {wbuf.get(), wend};
+    while (wend > 0) {
+        size_t nbytes = co_await link_.send (&iov, 1);
+        iov.iov_base = static_cast<char*> (iov.iov_base) + nbytes;
+        iov.iov_len -= nbytes;
+        wend -= nbytes;
+    }
+}
+
+// Descriptors ride on the first byte of a sendmsg, so pending
+// output goes first and the message itself is not buffered.
+task<> sockbuf::write_fd (const void* buffer, size_t bufsize, int fd) {
+    co_await flush();
+    const char* bufptr = static_cast<const char*> (buffer);
+    size_t nbytes = co_await link_.send_fd (bufptr, bufsize, fd);
+    while (nbytes < bufsize) {
+        iovec iov {const_cast<char*> (bufptr + nbytes),
+                   bufsize - nbytes};
+        nbytes += co_await link_.send (&iov, 1);
+    }
+}
+
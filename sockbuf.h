@@ -0,0 +1,63 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// sockbuf.h
+// sockbuf file
+// CMPS 109
+// Assignment 4
+
+//
+// class sockbuf
+// read-ahead and write-behind buffering over a transport, or over
+// a base_socket through a socket_transport of its own.
+// Small reads (headers, short replies) are served from one large
+// recv into the read buffer, small writes are coalesced into the
+// write buffer, and large transfers bypass the copy entirely.
+// Like a tied stdio stream, pending output is flushed before any
+// read has to go to the socket, so a request is never stranded
+// in the write buffer while waiting for its reply.
+// All I/O methods are coroutines on top of the transport's send
+// and recv; see async.h for how they run with and without a
+// scheduler.
+//
+
+#ifndef __SOCKBUF_H__
+#define __SOCKBUF_H__
+
+#include <cstdlib>
+#include <memory>
+using namespace std;
+
+#include "async.h"
+#include "sockets.h"
+#include "transport.h"
+
+class sockbuf {
+   public:
+      static constexpr size_t BUFSIZE = 0x40000;
+      static constexpr size_t ALIGNMENT = 64; // cache line
+   private:
+      using buffer_ptr = unique_ptr<char, void (*) (void*)>;
+      transport_ptr own_link;
+      transport& link_;
+      buffer_ptr rbuf;
+      buffer_ptr wbuf;
+      size_t rpos {0};
+      size_t rend {0};
+      size_t wend {0};
+      task<size_t> fill();
+   public:
+      explicit sockbuf (base_socket& socket);
+      explicit sockbuf (transport& link);
+      sockbuf (const sockbuf&) = delete;
+      sockbuf& operator= (const sockbuf&) = delete;
+      task<> read (void* buffer, size_t bufsize);
+      task<> write (const void* buffer, size_t bufsize);
+      task<> flush();
+      task<> write_fd (const void* buffer, size_t bufsize, int fd);
+      size_t available() const { return rend - rpos; }
+      size_t pending() const { return wend; }
+      transport& link() { return link_; }
+};
+
+#endif
+
@@ -10,10 +10,12 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <utility>
 using namespace std;
 
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/stat.h>
 
 #include "sockets.h"
 
@@ -26,15 +28,37 @@ base_socket::~base_socket() {
 }
 
 void base_socket::close() {
+    if (passed_fd != CLOSED_FD) ::close (passed_fd);
+    passed_fd = CLOSED_FD;
     int status = ::close (socket_fd);
     if (status < 0) throw socket_sys_error ("close("
                         + to_string(socket_fd) + ")");
     socket_fd = CLOSED_FD;
 }
 
-void base_socket::create() {
-    socket_fd = ::socket (AF_INET, SOCK_STREAM, 0);
+bool is_unix_address (const string& address) {
+    return address.compare (0, strlen (UNIX_PREFIX), UNIX_PREFIX) == 0;
+}
+
+string unix_path (const string& address) {
+    return address.substr (strlen (UNIX_PREFIX));
+}
+
+static sockaddr_un local_address (const string& path) {
+    sockaddr_un addr {};
+    if (path.size() >= sizeof addr.sun_path) {
+        throw socket_error (path + ": socket path too long");
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy (addr.sun_path, path.c_str(), path.size());
+    return addr;
+}
+
+void base_socket::create (int family) {
+    socket_fd = ::socket (family, SOCK_STREAM, 0);
     if (socket_fd < 0) throw socket_sys_error ("socket");
+    socket_addr.generic.sa_family = family;
+    if (family != AF_INET) return;
     int on = 1;
     int status = ::setsockopt (socket_fd, SOL_SOCKET, SO_REUSEADDR,
                                &on, sizeof on);
@@ -42,28 +66,73 @@ void base_socket::create() {
 }
 
 void base_socket::bind (const in_port_t port) {
-    socket_addr.sin_family = AF_INET;
-    socket_addr.sin_addr.s_addr = INADDR_ANY;
-    socket_addr.sin_port = htons (port);
-    int status = ::bind (socket_fd,
-                         reinterpret_cast<sockaddr*> (&socket_addr),
-                         sizeof socket_addr);
+    socket_addr.inet.sin_family = AF_INET;
+    socket_addr.inet.sin_addr.s_addr = INADDR_ANY;
+    socket_addr.inet.sin_port = htons (port);
+    int status = ::bind (socket_fd, &socket_addr.generic,
+                         sizeof socket_addr.inet);
     if (status < 0) throw socket_sys_error ("bind(" + to_string (port)
                                             + ")");
 }
 
+// A socket file nothing listens on, left by a server that died, is
+// replaced.  One that still accepts connections belongs to a live
+// server and is left alone: the bind fails with EADDRINUSE.
+static bool stale_socket (const sockaddr_un& addr) {
+    struct stat stat_buf;
+    if (::lstat (addr.sun_path, &stat_buf) < 0
+        or not S_ISSOCK (stat_buf.st_mode)) return false;
+    int probe = ::socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) return false;
+    int status = ::connect (probe,
+                            reinterpret_cast<const sockaddr*> (&addr),
+                            sizeof addr);
+    bool refused = status < 0 and errno == ECONNREFUSED;
+    ::close (probe);
+    return refused;
+}
+
+void base_socket::bind (const string& path) {
+    socket_addr.local = local_address (path);
+    if (stale_socket (socket_addr.local)) ::unlink (path.c_str());
+    int status = ::bind (socket_fd, &socket_addr.generic,
+                         sizeof socket_addr.local);
+    if (status < 0) throw socket_sys_error ("bind(" + path + ")");
+}
+
 void base_socket::listen() const {
     int status = ::listen (socket_fd, SOMAXCONN);
     if (status < 0) throw socket_sys_error ("listen");
 }
 
 
+// Unix peers are unnamed, so accepted sockets are labelled with
+// the listener's path instead.
 void base_socket::accept (base_socket& socket) const {
     int addr_length = sizeof socket.socket_addr;
     socket.socket_fd = ::accept (socket_fd,
                reinterpret_cast<sockaddr*> (&socket.socket_addr),
                reinterpret_cast<socklen_t*> (&addr_length));
     if (socket.socket_fd < 0) throw socket_sys_error ("accept");
+    if (family() == AF_UNIX) socket.socket_addr = socket_addr;
+}
+
+// Non-blocking listener only; false if no connection is pending.
+bool base_socket::try_accept (base_socket& socket) const {
+    socklen_t addr_length = sizeof socket.socket_addr;
+    socket.socket_fd = ::accept4 (socket_fd,
+               reinterpret_cast<sockaddr*> (&socket.socket_addr),
+               &addr_length, SOCK_CLOEXEC);
+    if (socket.socket_fd >= 0) {
+        if (family() == AF_UNIX) socket.socket_addr = socket_addr;
+        return true;
+    }
+    switch (errno) {
+        case EAGAIN: case EINTR: case ECONNABORTED:
+            return false;
+        default:
+            throw socket_sys_error ("accept");
+    }
 }
 
 ssize_t base_socket::send (const void* buffer, size_t bufsize) {
@@ -72,27 +141,148 @@ ssize_t base_socket::send (const void* buffer, size_t bufsize) {
     return nbytes;
 }
 
+ssize_t base_socket::send (const iovec* iov, size_t iovcnt) {
+    msghdr message {};
+    message.msg_iov = const_cast<iovec*> (iov);
+    message.msg_iovlen = iovcnt;
+    ssize_t nbytes = ::sendmsg (socket_fd, &message, MSG_NOSIGNAL);
+    if (nbytes < 0) throw socket_sys_error ("sendmsg");
+    return nbytes;
+}
+
 ssize_t base_socket::recv (void* buffer, size_t bufsize) {
-    memset (buffer, 0, bufsize);
-    ssize_t nbytes = ::recv (socket_fd, buffer, bufsize, 0);
+    ssize_t nbytes = family() == AF_UNIX
+                   ? recv_message (buffer, bufsize, 0)
+                   : ::recv (socket_fd, buffer, bufsize, 0);
     if (nbytes < 0) throw socket_sys_error ("recv");
     return nbytes;
 }
 
+static ssize_t would_block (ssize_t nbytes, const string& what) {
+    if (nbytes < 0 and errno != EAGAIN and errno != EINTR) {
+        throw socket_sys_error (what);
+    }
+    return nbytes;
+}
+
+ssize_t base_socket::try_send (const void* buffer, size_t bufsize) {
+    return would_block (::send (socket_fd, buffer, bufsize,
+                                MSG_NOSIGNAL | MSG_DONTWAIT), "send");
+}
+
+ssize_t base_socket::try_send (const iovec* iov, size_t iovcnt) {
+    msghdr message {};
+    message.msg_iov = const_cast<iovec*> (iov);
+    message.msg_iovlen = iovcnt;
+    return would_block (::sendmsg (socket_fd, &message,
+                                   MSG_NOSIGNAL | MSG_DONTWAIT),
+                        "sendmsg");
+}
+
+ssize_t base_socket::try_recv (void* buffer, size_t bufsize) {
+    if (family() == AF_UNIX) {
+        return would_block (recv_message (buffer, bufsize,
+                                          MSG_DONTWAIT), "recvmsg");
+    }
+    return would_block (::recv (socket_fd, buffer, bufsize,
+                                MSG_DONTWAIT), "recv");
+}
+
+// Receives bytes.  A peer may pass descriptors unasked, so all
+// are closed but the one a take_fd is waiting for.
+ssize_t base_socket::recv_message (void* buffer, size_t bufsize,
+                                   int flags) {
+    iovec iov {buffer, bufsize};
+    alignas (cmsghdr) char control[CMSG_SPACE (sizeof (int)
+                                               * MAX_PASSED_FDS)];
+    msghdr message {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof control;
+    ssize_t nbytes = ::recvmsg (socket_fd, &message,
+                                flags | MSG_CMSG_CLOEXEC);
+    if (nbytes < 0) return nbytes;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR (&message); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR (&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET
+            or cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+        for (size_t index = 0; index < count; ++index) {
+            int fd;
+            memcpy (&fd, CMSG_DATA (cmsg) + index * sizeof fd,
+                    sizeof fd);
+            if (expecting_fd and passed_fd == CLOSED_FD) passed_fd = fd;
+            else ::close (fd);
+        }
+    }
+    return nbytes;
+}
+
+ssize_t base_socket::send_message (const void* buffer, size_t bufsize,
+                                   int fd, int flags) {
+    iovec iov {const_cast<void*> (buffer), bufsize};
+    alignas (cmsghdr) char control[CMSG_SPACE (sizeof fd)] {};
+    msghdr message {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof control;
+    cmsghdr* cmsg = CMSG_FIRSTHDR (&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof fd);
+    memcpy (CMSG_DATA (cmsg), &fd, sizeof fd);
+    return ::sendmsg (socket_fd, &message, flags | MSG_NOSIGNAL);
+}
+
+ssize_t base_socket::send_fd (const void* buffer, size_t bufsize,
+                              int fd) {
+    ssize_t nbytes = send_message (buffer, bufsize, fd, 0);
+    if (nbytes < 0) throw socket_sys_error ("sendmsg(SCM_RIGHTS)");
+    return nbytes;
+}
+
+ssize_t base_socket::try_send_fd (const void* buffer, size_t bufsize,
+                                  int fd) {
+    return would_block (send_message (buffer, bufsize, fd,
+                                      MSG_DONTWAIT),
+                        "sendmsg(SCM_RIGHTS)");
+}
+
+// A descriptor left over from an earlier reply is dropped.
+void base_socket::expect_fd() {
+    if (passed_fd != CLOSED_FD) ::close (passed_fd);
+    passed_fd = CLOSED_FD;
+    expecting_fd = true;
+}
+
+int base_socket::take_fd() {
+    expecting_fd = false;
+    return exchange (passed_fd, CLOSED_FD);
+}
+
 void base_socket::connect (const string host, const in_port_t port) {
     struct hostent *hostp = ::gethostbyname (host.c_str());
     if (hostp == NULL) throw socket_h_error ("gethostbyname("
                                              + host + ")");
-    socket_addr.sin_family = AF_INET;
-    socket_addr.sin_port = htons (port);
-    socket_addr.sin_addr = *reinterpret_cast<in_addr*> (hostp->h_addr);
-    int status = ::connect (socket_fd,
-                            reinterpret_cast<sockaddr*> (&socket_addr),
-                            sizeof (socket_addr));
+    socket_addr.inet.sin_family = AF_INET;
+    socket_addr.inet.sin_port = htons (port);
+    socket_addr.inet.sin_addr =
+                 *reinterpret_cast<in_addr*> (hostp->h_addr);
+    int status = ::connect (socket_fd, &socket_addr.generic,
+                            sizeof (socket_addr.inet));
     if (status < 0) throw socket_sys_error ("connect(" + host + ":"
                                             + to_string (port) + ")");
 }
 
+void base_socket::connect (const string& path) {
+    socket_addr.local = local_address (path);
+    int status = ::connect (socket_fd, &socket_addr.generic,
+                            sizeof (socket_addr.local));
+    if (status < 0) throw socket_sys_error ("connect(" + path + ")");
+}
+
 void base_socket::set_socket_fd (int fd) {
     socklen_t addrlen = sizeof socket_addr;
     int rc = getpeername (fd, reinterpret_cast<sockaddr*>
@@ -101,8 +291,22 @@ void base_socket::set_socket_fd (int fd) {
     if (rc < 0) throw socket_sys_error ("set_socket_fd("
                        + to_string (fd) + "): getpeername");
     socket_fd = fd;
-    if (socket_addr.sin_family != AF_INET)
-        throw socket_error ("address not AF_INET");
+    if (family() != AF_INET and family() != AF_UNIX)
+        throw socket_error ("address not AF_INET or AF_UNIX");
+}
+
+in_addr base_socket::peer_address() const {
+    if (family() == AF_INET) return socket_addr.inet.sin_addr;
+    return in_addr {htonl (INADDR_LOOPBACK)};
+}
+
+pid_t base_socket::peer_pid() const {
+    if (family() != AF_UNIX) return 0;
+    ucred credentials {};
+    socklen_t length = sizeof credentials;
+    if (::getsockopt (socket_fd, SOL_SOCKET, SO_PEERCRED,
+                      &credentials, &length) < 0) return 0;
+    return credentials.pid;
 }
 
 void base_socket::set_non_blocking (const bool blocking) {
@@ -114,10 +318,22 @@ void base_socket::set_non_blocking (const bool blocking) {
     if (opts < 0) throw socket_sys_error ("fcntl");
 }
 
+bool base_socket::readable (int timeout_ms) const {
+    pollfd pfd {socket_fd, POLLIN, 0};
+    int status = ::poll (&pfd, 1, timeout_ms);
+    if (status < 0) throw socket_sys_error ("poll");
+    return status > 0;
+}
+
 
 client_socket::client_socket (string host, in_port_t port) {
-    base_socket::create();
-    base_socket::connect (host, port);
+    if (is_unix_address (host)) {
+        base_socket::create (AF_UNIX);
+        base_socket::connect (unix_path (host));
+    }else {
+        base_socket::create();
+        base_socket::connect (host, port);
+    }
 }
 
 server_socket::server_socket (in_port_t port) {
@@ -126,6 +342,12 @@ server_socket::server_socket (in_port_t port) {
     base_socket::listen();
 }
 
+server_socket::server_socket (const string& path) {
+    base_socket::create (AF_UNIX);
+    base_socket::bind (path);
+    base_socket::listen();
+}
+
 string to_string (const hostinfo& info) {
     return info.hostname + " (" + to_string (info.addresses[0]) + ")";
 }
@@ -139,9 +361,13 @@ string to_string (const in_addr& ipv4_addr) {
 }
 
 string to_string (const base_socket& sock) {
-    hostinfo info (sock.socket_addr.sin_addr);
+    if (sock.family() == AF_UNIX) {
+        return UNIX_PREFIX + string (sock.socket_addr.local.sun_path);
+    }
+    hostinfo info (sock.socket_addr.inet.sin_addr);
     return info.hostname + " (" + to_string (info.addresses[0])
-           + ") port " + to_string (ntohs (sock.socket_addr.sin_port));
+           + ") port "
+           + to_string (ntohs (sock.socket_addr.inet.sin_port));
 }
 
 
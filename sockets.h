@@ -17,12 +17,31 @@ using namespace std;
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+//
+// Addresses of the form unix:/path select an AF_UNIX stream socket
+// instead of TCP; the port is then ignored.  The wire protocol is
+// the same either way.
+//
+
+constexpr char UNIX_PREFIX[] = "unix:";
+bool is_unix_address (const string& address);
+string unix_path (const string& address);
+
+union socket_address {
+   sockaddr generic;
+   sockaddr_in inet;
+   sockaddr_un local;
+};
+
 //
 // class base_socket:
 // mostly protected and not used by applications
@@ -32,27 +51,54 @@ class base_socket {
    private:
       static constexpr size_t MAXRECV = 0xFFFF;
       static constexpr int CLOSED_FD = -1;
+      static constexpr size_t MAX_PASSED_FDS = 4;
       int socket_fd {CLOSED_FD};
-      sockaddr_in socket_addr;
+      socket_address socket_addr;
+      bool expecting_fd {false};
+      int passed_fd {CLOSED_FD};
+      ssize_t recv_message (void* buffer, size_t bufsize, int flags);
+      ssize_t send_message (const void* buffer, size_t bufsize,
+                            int fd, int flags);
    protected:
       base_socket(); // only derived classes may construct
       base_socket (const base_socket&) = delete; // prevent copying
       base_socket& operator= (const base_socket&) = delete;
       ~base_socket();
       // server_socket initialization
-      void create();
+      void create (int family = AF_INET);
       void bind (const in_port_t port);
+      void bind (const string& path);
       void listen() const;
       void accept (base_socket&) const;
+      bool try_accept (base_socket&) const;
       // client_socket initialization
       void connect (const string host, const in_port_t port);
+      void connect (const string& path);
       // accepted_socket initialization
       void set_socket_fd (int fd);
    public:
       void close();
       ssize_t send (const void* buffer, size_t bufsize);
+      ssize_t send (const iovec* iov, size_t iovcnt);
       ssize_t recv (void* buffer, size_t bufsize);
+      // non-blocking variants: -1 with errno EAGAIN if not ready
+      ssize_t try_send (const void* buffer, size_t bufsize);
+      ssize_t try_send (const iovec* iov, size_t iovcnt);
+      ssize_t try_recv (void* buffer, size_t bufsize);
+      // AF_UNIX only: pass fd with SCM_RIGHTS along with the bytes.
+      // Descriptors received by recv are closed, except that after
+      // expect_fd the first to arrive is kept for take_fd, which
+      // returns CLOSED_FD if none has.
+      ssize_t send_fd (const void* buffer, size_t bufsize, int fd);
+      ssize_t try_send_fd (const void* buffer, size_t bufsize, int fd);
+      void expect_fd();
+      int take_fd();
       void set_non_blocking (const bool);
+      bool readable (int timeout_ms) const;
+      int fd() const { return socket_fd; }
+      int family() const { return socket_addr.generic.sa_family; }
+      in_addr peer_address() const; // loopback for AF_UNIX
+      pid_t peer_pid() const; // SO_PEERCRED, 0 unless AF_UNIX
       friend string to_string (const base_socket& sock);
 };
 
@@ -86,9 +132,13 @@ class client_socket: public base_socket {
 class server_socket: public base_socket {
    public:
       server_socket (in_port_t port);
+      explicit server_socket (const string& path);
       void accept (accepted_socket& sock) {
          base_socket::accept (sock);
       }
+      bool try_accept (accepted_socket& sock) {
+         return base_socket::try_accept (sock);
+      }
 };
 
 
@@ -0,0 +1,63 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// trace.h
+// trace file
+// CMPS 109
+// Assignment 4
+
+//
+// Opt-in request tracing for cix and cixd.
+//
+// With CIX_TRACE naming a file, every process records timed spans
+// into an in-memory buffer and appends them to that file in the
+// Chrome trace JSON array format, which Perfetto and chrome://tracing
+// load directly.  The format allows the closing bracket to be
+// missing, so any number of processes append to the same file.
+// Buffers are flushed when full, at least once a second while
+// spans are recorded, and at exit, so a process killed by a signal
+// loses at most its last second.  A forked child starts with an
+// empty buffer.  Without CIX_TRACE a span costs one branch.
+//
+// class trace_span
+// records the time from construction to destruction.  track is
+// the Perfetto row (the thread id if negative); coroutines that
+// interleave on one thread use one track per connection.  A span
+// with a request id starts (trace_flow::OUT) or ends
+// (trace_flow::IN) a flow arrow, which joins a client request to
+// the server span that handled it.
+//
+// trace_request returns a fresh request id, or 0 if tracing is
+// off.  Timestamps are CLOCK_REALTIME, so traces from several
+// hosts can be concatenated as long as their clocks agree.
+//
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <cstdint>
+using namespace std;
+
+enum class trace_flow {NONE, OUT, IN};
+
+class trace_span {
+   private:
+      const char* name;
+      int track;
+      uint64_t request;
+      trace_flow flow;
+      int64_t start_ns {0};
+   public:
+      explicit trace_span (const char* name, int track = -1,
+                           uint64_t request = 0,
+                           trace_flow flow = trace_flow::NONE);
+      trace_span (const trace_span&) = delete;
+      trace_span& operator= (const trace_span&) = delete;
+      ~trace_span();
+};
+
+bool trace_enabled();
+uint64_t trace_request();
+void trace_flush();
+
+#endif
+
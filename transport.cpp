@@ -0,0 +1,322 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// transport.cpp
+// transport file
+// CMPS 109
+// Assignment 4
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+//
+// transport
+//
+
+task<size_t> transport::send_fd (const void*, size_t, int) {
+    throw socket_error (name() + ": cannot pass descriptors");
+}
+
+int transport::take_fd() {
+    return -1;
+}
+
+bool transport::readable (int timeout_ms) const {
+    pollfd pfd {fd(), POLLIN, 0};
+    int status;
+    do {
+        status = ::poll (&pfd, 1, timeout_ms);
+    }while (status < 0 and errno == EINTR);
+    return status > 0;
+}
+
+uint64_t transport::peer_key() const {
+    if (family() == AF_UNIX) return uint64_t {1} << 32 | peer_pid();
+    return peer_address().s_addr;
+}
+
+
+//
+// socket_transport
+//
+
+task<size_t> socket_transport::send (const iovec* iov, size_t iovcnt) {
+    return async_send (sock, iov, iovcnt);
+}
+
+task<size_t> socket_transport::recv (void* buffer, size_t bufsize) {
+    return async_recv (sock, buffer, bufsize);
+}
+
+task<size_t> socket_transport::send_fd (const void* buffer,
+                                        size_t bufsize, int fd) {
+    return async_send_fd (sock, buffer, bufsize, fd);
+}
+
+void socket_transport::shutdown() {
+    ::shutdown (sock.fd(), SHUT_RDWR);
+}
+
+
+//
+// memory_pipe
+//
+
+// One direction of a pipe: a ring buffer, and an eventfd for each
+// side to wait on.  An eventfd is reset before its side looks at
+// the buffer and signalled after the other side changes it, so a
+// change between the look and the wait is never missed.
+struct pipe_channel {
+   mutex lock;
+   vector<char> ring;
+   size_t head {0};
+   size_t used {0};
+   bool writer_closed {false};
+   bool reader_closed {false};
+   int readable_fd;
+   int writable_fd;
+   explicit pipe_channel (size_t capacity);
+   pipe_channel (const pipe_channel&) = delete;
+   pipe_channel& operator= (const pipe_channel&) = delete;
+   ~pipe_channel();
+   size_t put (const iovec* iov, size_t iovcnt);
+   size_t take (char* buffer, size_t bufsize);
+};
+
+static int make_eventfd() {
+    int fd = ::eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) throw socket_sys_error ("eventfd");
+    return fd;
+}
+
+// A full counter is still readable, so a failed write is harmless.
+static void signal_eventfd (int fd) {
+    uint64_t one = 1;
+    if (::write (fd, &one, sizeof one) < 0) return;
+}
+
+// EAGAIN means it was already reset.
+static void reset_eventfd (int fd) {
+    uint64_t count;
+    if (::read (fd, &count, sizeof count) < 0) return;
+}
+
+pipe_channel::pipe_channel (size_t capacity):
+        ring (max<size_t> (capacity, 1)),
+        readable_fd (make_eventfd()), writable_fd (make_eventfd()) {
+}
+
+pipe_channel::~pipe_channel() {
+    ::close (readable_fd);
+    ::close (writable_fd);
+}
+
+size_t pipe_channel::put (const iovec* iov, size_t iovcnt) {
+    size_t total = 0;
+    for (size_t index = 0; index < iovcnt; ++index) {
+        auto bufptr = static_cast<const char*> (iov[index].iov_base);
+        size_t bufsize = iov[index].iov_len;
+        while (bufsize > 0 and used < ring.size()) {
+            size_t tail = (head + used) % ring.size();
+            size_t ncopy = min ({bufsize, ring.size() - used,
+                                 ring.size() - tail});
+            memcpy (ring.data() + tail, bufptr, ncopy);
+            used += ncopy;
+            total += ncopy;
+            bufptr += ncopy;
+            bufsize -= ncopy;
+        }
+    }
+    return total;
+}
+
+size_t pipe_channel::take (char* buffer, size_t bufsize) {
+    size_t total = 0;
+    while (bufsize > 0 and used > 0) {
+        size_t ncopy = min ({bufsize, used, ring.size() - head});
+        memcpy (buffer, ring.data() + head, ncopy);
+        head = (head + ncopy) % ring.size();
+        used -= ncopy;
+        total += ncopy;
+        buffer += ncopy;
+        bufsize -= ncopy;
+    }
+    return total;
+}
+
+class memory_transport: public transport {
+   private:
+      shared_ptr<pipe_channel> in;
+      shared_ptr<pipe_channel> out;
+      string label;
+   public:
+      memory_transport (shared_ptr<pipe_channel> in_,
+                        shared_ptr<pipe_channel> out_,
+                        const string& label_):
+                        in (in_), out (out_), label (label_) {}
+      ~memory_transport() { shutdown(); }
+      task<size_t> send (const iovec* iov, size_t iovcnt) override;
+      task<size_t> recv (void* buffer, size_t bufsize) override;
+      void shutdown() override;
+      int fd() const override { return in->readable_fd; }
+      int family() const override { return AF_UNSPEC; }
+      in_addr peer_address() const override {
+         return {htonl (INADDR_LOOPBACK)};
+      }
+      string name() const override { return label; }
+};
+
+task<size_t> memory_transport::send (const iovec* iov, size_t iovcnt) {
+    for (;;) {
+        reset_eventfd (out->writable_fd);
+        {
+            lock_guard<mutex> guard (out->lock);
+            if (out->reader_closed or out->writer_closed) {
+                errno = EPIPE;
+                throw socket_sys_error (label + ": send");
+            }
+            size_t nbytes = out->put (iov, iovcnt);
+            if (nbytes > 0) {
+                signal_eventfd (out->readable_fd);
+                if (out->used < out->ring.size()) {
+                    signal_eventfd (out->writable_fd);
+                }
+                co_return nbytes;
+            }
+        }
+        co_await wait_readable (out->writable_fd);
+    }
+}
+
+task<size_t> memory_transport::recv (void* buffer, size_t bufsize) {
+    for (;;) {
+        reset_eventfd (in->readable_fd);
+        {
+            lock_guard<mutex> guard (in->lock);
+            if (in->reader_closed) co_return 0;
+            size_t nbytes = in->take (static_cast<char*> (buffer),
+                                      bufsize);
+            if (nbytes > 0) {
+                signal_eventfd (in->writable_fd);
+                if (in->used > 0) signal_eventfd (in->readable_fd);
+                co_return nbytes;
+            }
+            if (in->writer_closed) {
+                signal_eventfd (in->readable_fd);
+                co_return 0;
+            }
+        }
+        co_await wait_readable (in->readable_fd);
+    }
+}
+
+// Both directions end; waiters on either side are woken to see it.
+void memory_transport::shutdown() {
+    {
+        lock_guard<mutex> guard (in->lock);
+        in->reader_closed = true;
+    }
+    signal_eventfd (in->writable_fd);
+    signal_eventfd (in->readable_fd);
+    {
+        lock_guard<mutex> guard (out->lock);
+        out->writer_closed = true;
+    }
+    signal_eventfd (out->readable_fd);
+}
+
+pair<transport_ptr,transport_ptr> memory_pipe (size_t capacity) {
+    static atomic<unsigned> sequence {0};
+    string label = "memory pipe " + to_string (sequence++);
+    auto forward = make_shared<pipe_channel> (capacity);
+    auto backward = make_shared<pipe_channel> (capacity);
+    return {make_unique<memory_transport> (backward, forward,
+                                           label + " client"),
+            make_unique<memory_transport> (forward, backward,
+                                           label + " server")};
+}
+
+
+//
+// fault_transport
+//
+
+fault_transport::fault_transport (transport_ptr inner_,
+                                  const faults& plan_):
+        inner (move (inner_)), plan (plan_), random_state (plan_.seed) {
+}
+
+string fault_transport::name() const {
+    return inner->name() + " (faulty)";
+}
+
+// splitmix64, rather than <random>, whose distributions may differ
+// from one standard library to the next.
+uint64_t fault_transport::next_random() {
+    uint64_t value = random_state += 0x9E3779B97F4A7C15;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EB;
+    return value ^ (value >> 31);
+}
+
+void fault_transport::check_drop() {
+    if (not dropped and plan.drop_rate > 0
+        and (next_random() >> 11) * 0x1p-53 < plan.drop_rate) {
+        dropped = true;
+        inner->shutdown();
+    }
+    if (dropped) throw socket_error (name() + ": connection dropped");
+}
+
+size_t fault_transport::chunk (size_t bufsize) {
+    if (plan.max_chunk == 0 or bufsize <= 1) return bufsize;
+    size_t limit = min (bufsize, plan.max_chunk);
+    return 1 + next_random() % limit;
+}
+
+task<size_t> fault_transport::send (const iovec* iov, size_t iovcnt) {
+    check_drop();
+    co_await sleep_for (plan.latency);
+    // Only the first limit bytes of the vector are offered.
+    size_t total = 0;
+    for (size_t index = 0; index < iovcnt; ++index) {
+        total += iov[index].iov_len;
+    }
+    size_t limit = chunk (total);
+    vector<iovec> part;
+    for (size_t index = 0; index < iovcnt and limit > 0; ++index) {
+        size_t length = min (iov[index].iov_len, limit);
+        part.push_back ({iov[index].iov_base, length});
+        limit -= length;
+    }
+    size_t nbytes = co_await inner->send (part.data(), part.size());
+    if (plan.bandwidth > 0) {
+        co_await sleep_for (chrono::duration_cast
+                            <scheduler::clock::duration> (
+                            chrono::duration<double> (nbytes
+                                                   / plan.bandwidth)));
+    }
+    co_return nbytes;
+}
+
+task<size_t> fault_transport::recv (void* buffer, size_t bufsize) {
+    check_drop();
+    co_return co_await inner->recv (buffer, chunk (bufsize));
+}
+
+task<size_t> fault_transport::send_fd (const void* buffer,
+                                       size_t bufsize, int fd) {
+    check_drop();
+    co_return co_await inner->send_fd (buffer, bufsize, fd);
+}
+
@@ -0,0 +1,146 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// transport.h
+// transport file
+// CMPS 109
+// Assignment 4
+
+//
+// class transport
+// the byte stream under a sockbuf: a kernel socket, an in-memory
+// pipe, or a wrapper that adds faults to either.  send and recv
+// move at least one byte the way async_send and async_recv do,
+// waiting under a scheduler and blocking without one; recv returns
+// 0 at end of stream.  fd is readable whenever recv may have
+// something to return, so callers can wait on it with epoll next
+// to other descriptors.  Only AF_UNIX transports pass descriptors;
+// the others refuse send_fd and never have one to take.  A
+// descriptor is only kept for take_fd if expect_fd was called
+// before it arrived; any other is closed on arrival.  shutdown
+// ends the stream both ways, and the peer sees end of stream.
+// peer_key tells clients apart for per-client limits: by address,
+// or for a Unix socket by process, since every local peer has the
+// loopback address.
+//
+// class socket_transport
+// a base_socket as a transport.  The socket stays the caller's.
+//
+// memory_pipe
+// two connected transports with no kernel socket between them.
+// Each direction is a buffer of capacity bytes, and an eventfd per
+// direction stands in for readiness, so the ends can run on one
+// scheduler or on two threads (but not both blocking on one).
+// Destroying an end is end of stream for the other, whose sends
+// then fail with EPIPE.
+//
+// class fault_transport
+// another transport made to misbehave, the same way every run for
+// a given seed.  Each send waits latency first, then long enough
+// to keep to bandwidth bytes per second.  With max_chunk, each
+// send and recv moves a random 1 to max_chunk bytes, so partial
+// transfers are exercised.  Each operation drops the connection
+// with probability drop_rate: the inner transport is shut down and
+// every later operation throws socket_error.
+//
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+using namespace std;
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "async.h"
+#include "sockets.h"
+
+class transport {
+   public:
+      transport() = default;
+      transport (const transport&) = delete;
+      transport& operator= (const transport&) = delete;
+      virtual ~transport() = default;
+      virtual task<size_t> send (const iovec* iov, size_t iovcnt) = 0;
+      virtual task<size_t> recv (void* buffer, size_t bufsize) = 0;
+      virtual task<size_t> send_fd (const void* buffer, size_t bufsize,
+                                    int fd);
+      virtual void expect_fd() {}
+      virtual int take_fd();
+      virtual void shutdown() = 0;
+      virtual int fd() const = 0;
+      virtual int family() const = 0;
+      virtual in_addr peer_address() const = 0;
+      virtual pid_t peer_pid() const { return 0; }
+      virtual string name() const = 0;
+      bool readable (int timeout_ms) const;
+      uint64_t peer_key() const;
+};
+
+class socket_transport: public transport {
+   private:
+      base_socket& sock;
+   public:
+      explicit socket_transport (base_socket& socket): sock (socket) {}
+      task<size_t> send (const iovec* iov, size_t iovcnt) override;
+      task<size_t> recv (void* buffer, size_t bufsize) override;
+      task<size_t> send_fd (const void* buffer, size_t bufsize,
+                            int fd) override;
+      void expect_fd() override { sock.expect_fd(); }
+      int take_fd() override { return sock.take_fd(); }
+      void shutdown() override;
+      int fd() const override { return sock.fd(); }
+      int family() const override { return sock.family(); }
+      in_addr peer_address() const override {
+         return sock.peer_address();
+      }
+      pid_t peer_pid() const override { return sock.peer_pid(); }
+      string name() const override { return to_string (sock); }
+};
+
+using transport_ptr = unique_ptr<transport>;
+
+pair<transport_ptr,transport_ptr> memory_pipe (size_t capacity
+                                                = 0x40000);
+
+class fault_transport: public transport {
+   public:
+      struct faults {
+         chrono::microseconds latency {0};
+         double bandwidth {0};
+         size_t max_chunk {0};
+         double drop_rate {0};
+         uint64_t seed {1};
+      };
+   private:
+      transport_ptr inner;
+      const faults plan;
+      uint64_t random_state;
+      bool dropped {false};
+      uint64_t next_random();
+      void check_drop();
+      size_t chunk (size_t bufsize);
+   public:
+      fault_transport (transport_ptr inner_, const faults& plan_);
+      task<size_t> send (const iovec* iov, size_t iovcnt) override;
+      task<size_t> recv (void* buffer, size_t bufsize) override;
+      task<size_t> send_fd (const void* buffer, size_t bufsize,
+                            int fd) override;
+      void expect_fd() override { inner->expect_fd(); }
+      int take_fd() override { return inner->take_fd(); }
+      void shutdown() override { inner->shutdown(); }
+      int fd() const override { return inner->fd(); }
+      int family() const override { return inner->family(); }
+      in_addr peer_address() const override {
+         return inner->peer_address();
+      }
+      pid_t peer_pid() const override { return inner->peer_pid(); }
+      string name() const override;
+};
+
+#endif
+
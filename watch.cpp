@@ -0,0 +1,212 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// watch.cpp
+// watch file
+// CMPS 109
+// Assignment 4
+
+#include <algorithm>
+#include <cerrno>
+using namespace std;
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "watch.h"
+
+static constexpr uint32_t WATCH_MASK
+        = IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB
+        | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF
+        | IN_ONLYDIR;
+
+// A rotated log reappears under its name by create or rename.
+static constexpr uint32_t TAIL_DIRECTORY_MASK
+        = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+
+directory_watch::directory_watch (const cix_options& options,
+                                  size_t max_pending_):
+        max_pending (max_pending_) {
+    auto itor = options.find ("match");
+    if (itor != options.end()) pattern = itor->second;
+}
+
+directory_watch::~directory_watch() {
+    if (fd >= 0) ::close (fd);
+}
+
+int directory_watch::open (const string& path) {
+    fd = ::inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return errno;
+    if (::inotify_add_watch (fd, path.c_str(), WATCH_MASK) < 0) {
+        return errno;
+    }
+    return 0;
+}
+
+// A file created and deleted within one batch was never seen, and
+// one deleted and created again was modified.
+void directory_watch::add (watch_event::kind what, const string& name) {
+    if (overflow) return;
+    auto itor = pending.find (name);
+    if (itor == pending.end()) {
+        pending.emplace (name, what);
+        order.push_back (name);
+    }else if (what == watch_event::CREATE) {
+        itor->second = itor->second == watch_event::DELETE
+                     ? watch_event::MODIFY : watch_event::CREATE;
+    }else if (what == watch_event::MODIFY) {
+        if (itor->second != watch_event::CREATE) {
+            itor->second = watch_event::MODIFY;
+        }
+    }else if (itor->second == watch_event::CREATE) {
+        pending.erase (itor);
+    }else {
+        itor->second = watch_event::DELETE;
+    }
+    if (pending.size() > max_pending) {
+        overflow = true;
+        pending.clear();
+        order.clear();
+    }
+}
+
+void directory_watch::drain() {
+    alignas (inotify_event) char buffer[0x10000];
+    for (;;) {
+        ssize_t nbytes = ::read (fd, buffer, sizeof buffer);
+        if (nbytes < 0 and errno == EINTR) continue;
+        if (nbytes <= 0) return;
+        for (char* pos = buffer; pos < buffer + nbytes;) {
+            auto event = reinterpret_cast<inotify_event*> (pos);
+            pos += sizeof (inotify_event) + event->len;
+            uint32_t mask = event->mask;
+            if (mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF
+                        | IN_MOVE_SELF)) {
+                overflow = true;
+                pending.clear();
+                order.clear();
+                continue;
+            }
+            string name = event->len > 0 ? event->name : "";
+            if (name.empty() or name[0] == '.') continue;
+            if (not pattern.empty()
+                and ::fnmatch (pattern.c_str(), name.c_str(), 0) != 0) {
+                continue;
+            }
+            if (mask & (IN_CREATE | IN_MOVED_TO)) {
+                add (watch_event::CREATE, name);
+            }else if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+                add (watch_event::DELETE, name);
+            }else {
+                add (watch_event::MODIFY, name);
+            }
+        }
+    }
+}
+
+string directory_watch::take (size_t max_bytes) {
+    if (overflow) {
+        overflow = false;
+        return encode_events ({{watch_event::RESYNC, ""}});
+    }
+    string body;
+    while (not order.empty()) {
+        auto itor = pending.find (order.front());
+        if (itor == pending.end()) {
+            order.pop_front();
+            continue;
+        }
+        string line = encode_events ({{itor->second, itor->first}});
+        if (not body.empty()
+            and body.size() + line.size() > max_bytes) break;
+        body += line;
+        pending.erase (itor);
+        order.pop_front();
+    }
+    return body;
+}
+
+
+file_tail::file_tail (const string& path_): path (path_) {
+}
+
+file_tail::~file_tail() {
+    if (fd >= 0) ::close (fd);
+    if (notify >= 0) ::close (notify);
+}
+
+int file_tail::open() {
+    notify = ::inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (notify < 0) return errno;
+    size_t slash = path.find_last_of ('/');
+    string directory = slash == string::npos ? "."
+                     : slash == 0 ? "/" : path.substr (0, slash);
+    if (::inotify_add_watch (notify, directory.c_str(),
+                             TAIL_DIRECTORY_MASK) < 0) {
+        return errno;
+    }
+    return reopen();
+}
+
+// Switches to whatever file now has the name.  The watch on the
+// old file goes with it; if that file is gone, so is its watch.
+int file_tail::reopen() {
+    int file = ::open (path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    int error = 0;
+    if (file < 0 or ::fstat (file, &info) != 0) error = errno;
+    else if (S_ISDIR (info.st_mode)) error = EISDIR;
+    else if (not S_ISREG (info.st_mode)) error = EINVAL;
+    if (error != 0) {
+        if (file >= 0) ::close (file);
+        return error;
+    }
+    if (fd >= 0) ::close (fd);
+    if (watched >= 0) ::inotify_rm_watch (notify, watched);
+    fd = file;
+    device = info.st_dev;
+    inode = info.st_ino;
+    offset = 0;
+    watched = ::inotify_add_watch (notify, path.c_str(), IN_MODIFY);
+    return watched < 0 ? errno : 0;
+}
+
+void file_tail::drain() {
+    alignas (inotify_event) char buffer[0x1000];
+    for (;;) {
+        ssize_t nbytes = ::read (notify, buffer, sizeof buffer);
+        if (nbytes < 0 and errno == EINTR) continue;
+        if (nbytes <= 0) return;
+    }
+}
+
+// A file truncated and grown past offset between two calls looks
+// like it was appended to, as it does to tail.
+file_tail::progress file_tail::next (string& data, size_t max_bytes) {
+    data.clear();
+    struct stat info;
+    if (::fstat (fd, &info) != 0) return progress::FAILED;
+    if (info.st_size < offset) {
+        offset = 0;
+        return progress::RESTART;
+    }
+    if (info.st_size > offset) {
+        data.resize (min<off_t> (info.st_size - offset, max_bytes));
+        ssize_t nbytes = ::pread (fd, data.data(), data.size(), offset);
+        if (nbytes < 0) return progress::FAILED;
+        data.resize (nbytes);
+        offset += nbytes;
+        return nbytes > 0 ? progress::DATA : progress::IDLE;
+    }
+    if (::stat (path.c_str(), &info) != 0
+        or (info.st_dev == device and info.st_ino == inode)) {
+        return progress::IDLE;
+    }
+    int error = reopen();
+    if (error == ENOENT) return progress::IDLE;
+    errno = error;
+    return error == 0 ? progress::RESTART : progress::FAILED;
+}
@@ -0,0 +1,91 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// watch.h
+// watch file
+// CMPS 109
+// Assignment 4
+
+//
+// class directory_watch
+// inotify on one directory, folded into at most one pending event
+// per name so a burst of writes to a file is reported once.
+//
+// open returns 0 or errno.  descriptor is readable when inotify
+// has events; drain reads all of them without blocking.  Names
+// starting with a dot are ignored, which also hides the temporary
+// files of uploads in progress.  Past max_pending names, or when
+// the kernel queue overflows, the pending events are replaced by
+// a single RESYNC.  take removes up to max_bytes of encoded
+// events, oldest name first.
+//
+// class file_tail
+// one file followed as it grows, as tail -F does.  open returns 0
+// or errno.  descriptor is readable when inotify reports a write
+// to the file or a name created in its directory; drain discards
+// those events, since next looks at the file itself.  next sets
+// data to up to max_bytes not yet read and returns DATA, or
+// RESTART when the file was truncated or another file took its
+// name, which is then read from offset 0, or IDLE once caught up.
+// A replaced file is read to its end before the switch.  FAILED
+// leaves the reason in errno.
+//
+
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+using namespace std;
+
+#include <sys/types.h>
+
+#include "protocol.h"
+
+class directory_watch {
+   private:
+      int fd {-1};
+      string pattern;
+      size_t max_pending;
+      deque<string> order;
+      unordered_map<string,watch_event::kind> pending;
+      bool overflow {false};
+      void add (watch_event::kind what, const string& name);
+   public:
+      directory_watch (const cix_options& options,
+                       size_t max_pending = 4096);
+      directory_watch (const directory_watch&) = delete;
+      directory_watch& operator= (const directory_watch&) = delete;
+      ~directory_watch();
+      int open (const string& path);
+      int descriptor() const { return fd; }
+      void drain();
+      bool empty() const { return pending.empty() and not overflow; }
+      string take (size_t max_bytes);
+};
+
+class file_tail {
+   public:
+      enum class progress {IDLE, DATA, RESTART, FAILED};
+   private:
+      string path;
+      int notify {-1};
+      int watched {-1};
+      int fd {-1};
+      dev_t device {};
+      ino_t inode {};
+      off_t offset {0};
+      int reopen();
+   public:
+      explicit file_tail (const string& path);
+      file_tail (const file_tail&) = delete;
+      file_tail& operator= (const file_tail&) = delete;
+      ~file_tail();
+      int open();
+      int descriptor() const { return notify; }
+      void drain();
+      progress next (string& data, size_t max_bytes);
+};
+
+#endif
+
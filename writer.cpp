@@ -0,0 +1,479 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// writer.cpp
+// writer file
+// CMPS 109
+// Assignment 4
+
+#include <atomic>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+using namespace std;
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "extents.h"
+#include "writer.h"
+
+static constexpr auto POLL_INTERVAL = chrono::milliseconds (1);
+
+// Tickets: an upload whose data is written takes the next ticket
+// and is durable once completed reaches it.  The leader records
+// the last ticket issued before it starts syncfs.
+struct write_engine::shared_state {
+   atomic<uint64_t> requested {0};
+   atomic<uint64_t> completed {0};
+   atomic<pid_t> leader {0};
+};
+static_assert (atomic<uint64_t>::is_always_lock_free);
+
+static string directory_of (const string& path) {
+    size_t slash = path.find_last_of ('/');
+    if (slash == string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr (0, slash);
+}
+
+// Tries hidden names next to target until make succeeds on one,
+// which is returned in name; make fails with EEXIST while a name
+// is taken.
+static int make_temp (const string& target, string& name,
+                      const function<int (const string&)>& make) {
+    string directory = directory_of (target);
+    string base = target.substr (target.find_last_of ('/') + 1);
+    static unsigned sequence = 0;
+    for (;;) {
+        string candidate = directory + "/." + base + ".cix."
+                         + to_string (::getpid()) + "."
+                         + to_string (sequence++);
+        int error = make (candidate);
+        if (error == 0) {
+            name = candidate;
+            return 0;
+        }
+        if (error != EEXIST) return error;
+    }
+}
+
+// A file that replaces another takes its mode, and its owner where
+// we may set that, not the creation mode, so a PUT never widens
+// the access to a private file.  Owner first: chown clears setuid.
+static int keep_attributes (int fd, const string& path) {
+    struct stat old;
+    if (::stat (path.c_str(), &old) < 0) {
+        return errno == ENOENT ? 0 : errno;
+    }
+    if (::fchown (fd, old.st_uid, old.st_gid) < 0 and errno != EPERM) {
+        return errno;
+    }
+    return ::fchmod (fd, old.st_mode & 07777) < 0 ? errno : 0;
+}
+
+static bool same_attributes (const struct stat& one,
+                             const struct stat& other) {
+    return one.st_mode == other.st_mode and one.st_uid == other.st_uid
+       and one.st_gid == other.st_gid;
+}
+
+static int link_to (const string& source, const string& name) {
+    return ::link (source.c_str(), name.c_str()) < 0 ? errno : 0;
+}
+
+// Work handed to a thread of its own, on duplicates of the
+// descriptors it uses.  The thread shares this with the waiting
+// task, so either may end first.
+struct thread_call {
+   int fd {-1};
+   int other {-1};
+   int done {-1};
+   atomic<int> error {0};
+   ~thread_call() {
+      if (fd >= 0) ::close (fd);
+      if (other >= 0) ::close (other);
+      if (done >= 0) ::close (done);
+   }
+};
+
+// Under a scheduler call runs off the event loop, so the other
+// clients of an event driven server are served while it waits for
+// the disk.  Without one, or without a thread, it runs here.  call
+// is given fd and other, which may be -1, and returns an errno.
+static task<int> off_loop (int fd, int other,
+                           function<int (int, int)> call) {
+    auto state = make_shared<thread_call>();
+    if (scheduler::current() != nullptr) {
+        state->fd = ::fcntl (fd, F_DUPFD_CLOEXEC, 0);
+        if (other >= 0) {
+            state->other = ::fcntl (other, F_DUPFD_CLOEXEC, 0);
+        }
+        state->done = ::eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    if (state->fd < 0 or (other >= 0 and state->other < 0)
+        or state->done < 0) {
+        co_return call (fd, other);
+    }
+    try {
+        thread ([state, call]() {
+            state->error = call (state->fd, state->other);
+            uint64_t one = 1;
+            if (::write (state->done, &one, sizeof one) < 0) return;
+        }).detach();
+    }catch (system_error&) {
+        co_return call (fd, other);
+    }
+    co_await wait_readable (state->done);
+    co_return state->error.load();
+}
+
+static task<int> flush (int fd, int (*call) (int)) {
+    return off_loop (fd, -1, [call] (int target, int) {
+        return call (target) < 0 ? errno : 0;
+    });
+}
+
+// pwrite at position, or write at the end of a file opened with
+// O_APPEND when position is negative, until all of buffer is out.
+static int write_fully (int fd, const char* buffer, size_t bufsize,
+                        off_t position) {
+    while (bufsize > 0) {
+        ssize_t nbytes = position < 0
+                       ? ::write (fd, buffer, bufsize)
+                       : ::pwrite (fd, buffer, bufsize, position);
+        if (nbytes < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        buffer += nbytes;
+        bufsize -= nbytes;
+        if (position >= 0) position += nbytes;
+    }
+    return 0;
+}
+
+write_engine::sync_policy to_sync_policy (const string& name) {
+    if (name == "none") return write_engine::sync_policy::NONE;
+    if (name == "file") return write_engine::sync_policy::PER_FILE;
+    if (name == "batch") return write_engine::sync_policy::BATCH;
+    throw invalid_argument ("sync policy " + name);
+}
+
+write_engine::write_engine (const config& conf_): conf (conf_) {
+    void* memory = ::mmap (nullptr, sizeof (shared_state),
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw bad_alloc();
+    state = new (memory) shared_state();
+}
+
+write_engine::~write_engine() {
+    ::munmap (state, sizeof (shared_state));
+}
+
+void write_engine::reap (pid_t pid) {
+    state->leader.compare_exchange_strong (pid, 0);
+}
+
+task<int> write_engine::sync (int fd) {
+    switch (conf.policy) {
+        case sync_policy::NONE:
+            co_return 0;
+        case sync_policy::PER_FILE:
+            co_return co_await flush (fd, ::fdatasync);
+        case sync_policy::BATCH:
+            co_return co_await group_sync (fd);
+    }
+    co_return EINVAL;
+}
+
+task<int> write_engine::sync_directory (const string& path) {
+    if (conf.policy == sync_policy::NONE) co_return 0;
+    int dir_fd = ::open (directory_of (path).c_str(),
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) co_return errno;
+    int error = co_await sync (dir_fd);
+    ::close (dir_fd);
+    co_return error;
+}
+
+// A failed syncfs does not advance completed, so its followers
+// retry as leaders and see the error for themselves.
+task<int> write_engine::group_sync (int fd) {
+    uint64_t ticket = ++state->requested;
+    pid_t self = ::getpid();
+    while (state->completed.load() < ticket) {
+        pid_t idle = 0;
+        if (not state->leader.compare_exchange_strong (idle, self)) {
+            co_await sleep_for (POLL_INTERVAL);
+            continue;
+        }
+        co_await sleep_for (conf.batch_window);
+        uint64_t target = state->requested.load();
+        int error = co_await flush (fd, ::syncfs);
+        if (error == 0) state->completed.store (target);
+        state->leader.store (0);
+        if (error != 0) co_return error;
+    }
+    co_return 0;
+}
+
+
+//
+// write_engine::upload
+//
+
+write_engine::upload::~upload() {
+    if (fd >= 0) ::close (fd);
+    if (not temp.empty()) ::unlink (temp.c_str());
+}
+
+int write_engine::upload::open (const string& path_, size_t size) {
+    path = path_;
+    int error = make_temp (path, temp, [this](const string& name) {
+        fd = ::open (name.c_str(),
+                     O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        return fd < 0 ? errno : 0;
+    });
+    if (error == 0) error = keep_attributes (fd, path);
+    if (error != 0) return error;
+    expect (size);
+    return allocate (0, size);
+}
+
+int write_engine::upload::open_link (const string& path_,
+                                     const string& source) {
+    path = path_;
+    return make_temp (path, temp, [&source](const string& name) {
+        return link_to (source, name);
+    });
+}
+
+void write_engine::upload::expect (size_t size) {
+    stream.emplace (fd, io_stream::direction::WRITE, size,
+                    engine.conf.io);
+}
+
+int write_engine::upload::allocate (off_t start, size_t length) {
+    if (length > 0 and ::fallocate (fd, 0, start, length) < 0
+        and errno != EOPNOTSUPP) return errno;
+    return 0;
+}
+
+int write_engine::upload::write (const char* buffer, size_t bufsize) {
+    int error = write_at (buffer, bufsize, offset);
+    if (error == 0) offset += bufsize;
+    return error;
+}
+
+int write_engine::upload::write_at (const char* buffer,
+                                    size_t bufsize, off_t position) {
+    int error = write_fully (fd, buffer, bufsize, position);
+    if (error == 0 and stream) stream->advance (position, bufsize);
+    return error;
+}
+
+int write_engine::upload::truncate (off_t size) {
+    return ::ftruncate (fd, size) < 0 ? errno : 0;
+}
+
+// Only a dense source is preallocated; a sparse one would have
+// its holes filled in.  Without a reflink the copy reads the whole
+// file, so it runs off the event loop as a flush does.
+task<int> write_engine::upload::copy_from (int source) {
+    if (::ioctl (fd, FICLONE, source) == 0) co_return 0;
+    struct stat stat_buf;
+    if (::fstat (source, &stat_buf) < 0) co_return errno;
+    off_t size = stat_buf.st_size;
+    int error = 0;
+    if (allocated_bytes (stat_buf) == size) error = allocate (0, size);
+    if (error != 0) co_return error;
+    auto copy = [size] (int target, int from) {
+        int status = copy_extents (from, target, size);
+        if (status != 0) return status;
+        return ::ftruncate (target, size) < 0 ? errno : 0;
+    };
+    co_return co_await off_loop (fd, source, copy);
+}
+
+// Data barrier, rename, then a second barrier for the directory
+// entry: the ACK is only sent once both would survive a crash.
+// A link has no data of its own to sync.
+task<int> write_engine::upload::commit() {
+    if (stream) stream->finish();
+    if (fd >= 0) {
+        int error = co_await engine.sync (fd);
+        if (error != 0) co_return error;
+        int status = ::close (exchange (fd, -1));
+        if (status < 0) co_return errno;
+    }
+    if (::rename (temp.c_str(), path.c_str()) < 0) co_return errno;
+    temp.clear();
+    co_return co_await engine.sync_directory (path);
+}
+
+// An existing blob of the same size takes the place of what was
+// written.  If its mode or owner differ, a link would change them,
+// so what was written is committed unshared.  Otherwise it becomes
+// the blob, replacing one of another size, which cannot hold the
+// same contents.  It is synced first whatever the policy: the
+// store hands a blob out by its name alone, so after a crash it
+// must not be short of data.
+// A blob collected meanwhile is simply stored again.
+task<int> write_engine::upload::commit (const string& blob) {
+    if (stream) stream->finish();
+    struct stat written;
+    if (::fstat (fd, &written) < 0) co_return errno;
+    struct stat stored;
+    if (::stat (blob.c_str(), &stored) == 0
+        and stored.st_size == written.st_size) {
+        if (not same_attributes (stored, written)) {
+            co_return co_await commit();
+        }
+        string linked;
+        auto link_blob = [&blob](const string& name) {
+            return link_to (blob, name);
+        };
+        int error = make_temp (path, linked, link_blob);
+        if (error == 0) {
+            ::close (exchange (fd, -1));
+            ::unlink (temp.c_str());
+            temp = linked;
+        }else if (error != ENOENT and error != EXDEV) {
+            co_return error;
+        }
+    }
+    if (fd >= 0) {
+        int error = 0;
+        if (engine.conf.policy != sync_policy::NONE) {
+            error = co_await engine.sync (fd);
+        }else {
+            error = co_await flush (fd, ::fdatasync);
+        }
+        if (error != 0) co_return error;
+        if (::close (exchange (fd, -1)) < 0) co_return errno;
+        string entry;
+        error = make_temp (blob, entry, [this](const string& name) {
+            return link_to (temp, name);
+        });
+        if (error == 0 and ::rename (entry.c_str(), blob.c_str()) < 0) {
+            error = errno;
+            ::unlink (entry.c_str());
+        }
+        if (error == 0) error = co_await engine.sync_directory (blob);
+        // A store on another filesystem leaves the file unshared.
+        if (error != 0 and error != EXDEV) co_return error;
+    }
+    if (::rename (temp.c_str(), path.c_str()) < 0) co_return errno;
+    temp.clear();
+    co_return co_await engine.sync_directory (path);
+}
+
+
+
+//
+// write_engine::update
+//
+
+write_engine::update::~update() {
+    if (fd >= 0) ::close (fd);
+}
+
+// O_NONBLOCK keeps a FIFO from hanging the open; anything but a
+// regular file is refused anyway.  The file is readable so that
+// unshare can copy it.
+int write_engine::update::open (const string& path_, bool append) {
+    path = path_;
+    appending = append;
+    int flags = O_RDWR | O_NONBLOCK | O_CLOEXEC
+              | (append ? O_APPEND : 0);
+    fd = ::open (path.c_str(), flags | O_CREAT | O_EXCL, 0666);
+    created = fd >= 0;
+    if (fd < 0 and errno == EEXIST) fd = ::open (path.c_str(), flags);
+    if (fd < 0) return errno;
+    struct stat stat_buf;
+    if (::fstat (fd, &stat_buf) < 0) return errno;
+    return S_ISREG (stat_buf.st_mode) ? 0 : EINVAL;
+}
+
+// flock is retried rather than blocked on, so an event driven
+// server goes on serving its other clients meanwhile.  If path was
+// replaced while we waited, as by a PUT or an unshare, the lock is
+// on a file nobody will read again, so the new one is opened and
+// locked instead.
+task<int> write_engine::update::lock() {
+    for (;;) {
+        while (::flock (fd, LOCK_EX | LOCK_NB) < 0) {
+            if (errno != EWOULDBLOCK and errno != EINTR) {
+                co_return errno;
+            }
+            co_await sleep_for (POLL_INTERVAL);
+        }
+        struct stat locked;
+        struct stat named;
+        if (::fstat (fd, &locked) < 0) co_return errno;
+        if (::stat (path.c_str(), &named) == 0
+            and named.st_dev == locked.st_dev
+            and named.st_ino == locked.st_ino) co_return 0;
+        ::close (exchange (fd, -1));
+        int error = open (path, appending);
+        if (error != 0) co_return error;
+    }
+}
+
+// The copy is locked before it replaces the file, so updates that
+// were waiting for the old one move on to it and queue behind us.
+task<int> write_engine::update::unshare() {
+    struct stat stat_buf;
+    if (::fstat (fd, &stat_buf) < 0) co_return errno;
+    if (stat_buf.st_nlink <= 1) co_return 0;
+    upload copy (engine);
+    int error = copy.open (path, 0);
+    if (error == 0) error = co_await copy.copy_from (fd);
+    if (error == 0 and ::flock (copy.fd, LOCK_EX) < 0) error = errno;
+    int own = -1;
+    if (error == 0) {
+        own = ::fcntl (copy.fd, F_DUPFD_CLOEXEC, 0);
+        if (own < 0) error = errno;
+    }
+    if (error == 0 and appending
+        and ::fcntl (own, F_SETFL, O_APPEND) < 0) error = errno;
+    if (error == 0) error = co_await copy.commit();
+    if (error != 0) {
+        if (own >= 0) ::close (own);
+        co_return error;
+    }
+    ::close (exchange (fd, own));
+    co_return 0;
+}
+
+int write_engine::update::append (const char* buffer, size_t bufsize) {
+    return write_fully (fd, buffer, bufsize, -1);
+}
+
+int write_engine::update::write_at (const char* buffer,
+                                    size_t bufsize, off_t position) {
+    if (position < 0) return EINVAL;
+    return write_fully (fd, buffer, bufsize, position);
+}
+
+// The lock is held through the data barrier and released by the
+// close; a new file's directory entry gets its own barrier.
+task<int> write_engine::update::commit() {
+    int error = co_await engine.sync (fd);
+    int status = ::close (exchange (fd, -1));
+    if (error == 0 and status < 0) error = errno;
+    if (error == 0 and created) {
+        error = co_await engine.sync_directory (path);
+    }
+    co_return error;
+}
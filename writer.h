@@ -0,0 +1,146 @@
+// Jordan Leggett jleggett
+// Eduardo Zamora ezamora9
+// writer.h
+// writer file
+// CMPS 109
+// Assignment 4
+
+//
+// class write_engine
+// crash-safe file creation for cixd PUT, and in-place updates.
+//
+// An upload is written into a hidden temporary file next to its
+// destination, preallocated with fallocate, and committed by an
+// atomic rename, so readers see either the old file or the new
+// one and never a partial write.  The sync policy decides what a
+// commit waits for before the ACK:
+//    NONE      rename only; atomic but not durable after a crash.
+//    PER_FILE  fdatasync the file, rename, fsync the directory.
+//    BATCH     the same two barriers as group commits: one leader
+//              runs syncfs for every upload waiting on it, so
+//              concurrent uploads share each flush.  Leadership is
+//              in shared memory so forked servers batch together;
+//              a dead leader is cleared when it is reaped.
+// Under a scheduler each fdatasync or syncfs runs on a thread of
+// its own, so an event driven server is not stalled by the disk.
+// Errors are returned as errno values, 0 meaning success.
+// sync_directory applies the same policy to a directory entry
+// changed by other means, such as a server side rename.
+//
+// class write_engine::upload
+// one temporary file; destroyed before commit it is removed.
+// write_at and truncate build sparse files: whatever is never
+// written below the final size stays a hole.  copy_from fills it
+// from another file inside the kernel: a FICLONE reflink where
+// the filesystem shares extents, else copy_file_range of each
+// data extent, else plain reads and writes; holes are kept.  A
+// copy that is not a reflink runs off the event loop, as a flush.
+// A bulk upload, by the size given to open or expect, streams
+// through the page cache as io_policy describes.  One replacing a
+// file takes its mode, and its owner where permitted.  open_link makes
+// the upload another name for an existing file instead, with
+// nothing to write.  commit with a blob path shares the contents
+// through a blob_store: the upload becomes the blob, or if the
+// store already has it, path becomes another link to it, unless
+// their modes or owners differ: then path is not shared.
+//
+// class write_engine::update
+// an existing file changed in place, for APPEND and PUTRANGE, so
+// the cost is the size of the change and not of the file.  open
+// creates the file if it is missing.  Unlike an upload a reader
+// may see a change half done.  lock takes an exclusive flock so
+// concurrent updates of one file do not interleave, following the
+// file if it is replaced meanwhile; commit syncs as the policy
+// says and releases it.  unshare, called under the lock, first
+// gives a file with other names, such as a stored blob, a copy of
+// its own, so that they keep the old contents.
+//
+
+#ifndef __WRITER_H__
+#define __WRITER_H__
+
+#include <chrono>
+#include <optional>
+#include <string>
+using namespace std;
+
+#include <sys/types.h>
+
+#include "async.h"
+#include "iopolicy.h"
+
+class write_engine {
+   public:
+      enum class sync_policy {NONE, PER_FILE, BATCH};
+      struct config {
+         sync_policy policy {sync_policy::BATCH};
+         chrono::milliseconds batch_window {0};
+         io_policy io;
+      };
+      class update;
+      class upload {
+         private:
+            write_engine& engine;
+            int fd {-1};
+            string path;
+            string temp;
+            off_t offset {0};
+            optional<io_stream> stream;
+            friend class update;
+         public:
+            explicit upload (write_engine& engine_): engine (engine_) {}
+            upload (const upload&) = delete;
+            upload& operator= (const upload&) = delete;
+            ~upload();
+            int open (const string& path, size_t size);
+            int open_link (const string& path, const string& source);
+            void expect (size_t size);
+            int allocate (off_t start, size_t length);
+            int write (const char* buffer, size_t bufsize);
+            int write_at (const char* buffer, size_t bufsize,
+                          off_t position);
+            int truncate (off_t size);
+            task<int> copy_from (int source);
+            task<int> commit();
+            task<int> commit (const string& blob);
+      };
+      class update {
+         private:
+            write_engine& engine;
+            int fd {-1};
+            string path;
+            bool created {false};
+            bool appending {false};
+         public:
+            explicit update (write_engine& engine_): engine (engine_) {}
+            update (const update&) = delete;
+            update& operator= (const update&) = delete;
+            ~update();
+            int open (const string& path, bool append);
+            task<int> lock();
+            task<int> unshare();
+            int append (const char* buffer, size_t bufsize);
+            int write_at (const char* buffer, size_t bufsize,
+                          off_t position);
+            task<int> commit();
+      };
+   private:
+      struct shared_state;
+      const config conf;
+      shared_state* state;
+      task<int> sync (int fd);
+      task<int> group_sync (int fd);
+   public:
+      explicit write_engine (const config& conf);
+      write_engine (const write_engine&) = delete;
+      write_engine& operator= (const write_engine&) = delete;
+      ~write_engine();
+      const config& settings() const { return conf; }
+      task<int> sync_directory (const string& path);
+      void reap (pid_t pid); // async-signal-safe
+};
+
+write_engine::sync_policy to_sync_policy (const string& name);
+
+#endif
+